@@ -18,157 +18,737 @@
 
 */
 #define _CRT_SECURE_NO_WARNINGS
+#if (defined(JAMRAMFS_THREADS) || defined(JAMRAMFS_MMAP) || defined(JAMRAMFS_JOURNAL) \
+     || (!defined(JAMRAMFS_NO_STATS) && (defined(__unix__) || defined(__APPLE__)))) && !defined(_POSIX_C_SOURCE)
+#define _POSIX_C_SOURCE 200809L
+#endif
 #include <stdio.h>
 #include <stdlib.h>//bsearch free realloc malloc qsort
 #include <string.h>//strncmp strcpy memset
+#include <stddef.h>//ptrdiff_t
 #include <stdint.h>
 
 #include "JamRAMFS.h"
-#define jamrampath_FREE 0
-#define jamrampath_FILE 1
-#define jamrampath_DIR  2
-#define jamrampath_FILE_ALREADY_OPEN 3
-static size_t numPaths;
-struct jamrampath{
-	char* path;
-	char* filedata;
-	size_t filesize;
-	int status;
+
+#ifdef JAMRAMFS_MMAP
+/*--build with JAMRAMFS_MMAP to have jfs_mount() map images rather than read them in--*/
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>//open
+#include <unistd.h>//close
+#endif
+
+#ifdef JAMRAMFS_JOURNAL
+/*--build with JAMRAMFS_JOURNAL for jfs_journal_open(), which needs fsync()--*/
+#include <errno.h>
+#include <fcntl.h>//open
+#include <unistd.h>//fsync ftruncate
+#endif
+
+#ifndef JAMRAMFS_NO_STATS
+/*--
+ operation counters and latency histograms for jfs_stats(), kept in
+ each thread's own record so counting writes nothing shared; build with
+ JAMRAMFS_NO_STATS to leave them out altogether
+--*/
+#include <time.h>//clock_gettime timespec_get
+enum { JST_CREATE, JST_READ, JST_WRITE, JST_DELETE, JST_DELETE_R, JST_FIND,
+       JST_JOPEN, JST_JSEEK, JST_JKDIR, JST_JREMOVE, JST_OPS };
+#define JST_LAT   40	// latency buckets, bucket i from 2^(i-1) ns up
+#define JST_DEPTH 32	// components walked per lookup, the last bucket takes the rest
+#define JST_SCAN  16	// kids table slots probed per component
+struct jstats {
+	unsigned long calls[JST_OPS];
+	unsigned long lat[JST_OPS][JST_LAT];
+	unsigned long depth[JST_DEPTH];
+	unsigned long scan[JST_SCAN];
+	long nodes;		// made less freed by this thread, only the sum means anything
+	long bytes;		// file content buffers, likewise
+};
+#endif
+
+#ifdef JAMRAMFS_THREADS
+/*--
+ build with JAMRAMFS_THREADS (and -pthread) to make every call safe
+ from any thread: each tree node carries a reader/writer lock, the
+ shared tables each have their own, and none are held across calls
+--*/
+#include <pthread.h>
+#include <sched.h>//sched_yield
+#include <unistd.h>//sysconf
+typedef pthread_rwlock_t jrwlock;
+typedef pthread_mutex_t jmutex;
+#define JRWLOCK_INIT   PTHREAD_RWLOCK_INITIALIZER
+#define JMUTEX_INIT    PTHREAD_MUTEX_INITIALIZER
+#define jrw_init(l)    pthread_rwlock_init((l), NULL)
+#define jrw_destroy(l) pthread_rwlock_destroy(l)
+#define jrw_rd(l)      pthread_rwlock_rdlock(l)
+#define jrw_wr(l)      pthread_rwlock_wrlock(l)
+#define jrw_tryrd(l)   (pthread_rwlock_tryrdlock(l) == 0)
+#define jrw_trywr(l)   (pthread_rwlock_trywrlock(l) == 0)
+#define jrw_unlock(l)  pthread_rwlock_unlock(l)
+#define jmx_lock(l)    pthread_mutex_lock(l)
+#define jmx_unlock(l)  pthread_mutex_unlock(l)
+#else
+typedef int jrwlock;
+typedef int jmutex;
+#define JRWLOCK_INIT   0
+#define JMUTEX_INIT    0
+#define jrw_init(l)    ((void)(l))
+#define jrw_destroy(l) ((void)(l))
+#define jrw_rd(l)      ((void)(l))
+#define jrw_wr(l)      ((void)(l))
+#define jrw_tryrd(l)   ((void)(l), 1)
+#define jrw_trywr(l)   ((void)(l), 1)
+#define jrw_unlock(l)  ((void)(l))
+#define jmx_lock(l)    ((void)(l))
+#define jmx_unlock(l)  ((void)(l))
+#endif
+
+#ifdef JAMRAMFS_THREADS
+#define jget(x)        __atomic_load_n(&(x), __ATOMIC_RELAXED)
+#define jset(x, v)     __atomic_store_n(&(x), (v), __ATOMIC_RELAXED)
+#define jgetacq(x)     __atomic_load_n(&(x), __ATOMIC_ACQUIRE)
+#define jsetrel(x, v)  __atomic_store_n(&(x), (v), __ATOMIC_RELEASE)
+#define jfence_acq()   __atomic_thread_fence(__ATOMIC_ACQUIRE)
+#define jfence_rel()   __atomic_thread_fence(__ATOMIC_RELEASE)
+#define jfence_full()  __atomic_thread_fence(__ATOMIC_SEQ_CST)
+#define jadd(x, v)     __atomic_add_fetch(&(x), (v), __ATOMIC_ACQ_REL)
+
+/*--
+ epoch based reclamation, so lookups can run with no locks at all:
+ a reader announces the global epoch it entered in, and anything a
+ writer unlinks is only freed once the global epoch has moved on
+ twice, which cannot happen while a reader from before is still in.
+ Each thread's record also holds its own counters, summed on read.
+--*/
+struct jthread {
+	unsigned long epoch;	//0 outside, else the epoch it entered in
+	unsigned long nest;		//owner only
+	unsigned long hits;		//path cache, owner writes, anyone reads
+	unsigned long misses;
+#ifndef JAMRAMFS_NO_STATS
+	struct jstats st;
+#endif
+	int finding;			//inside a find callback, owner only
+	int inuse;
+	struct jthread* next;
+	char pad[64];			//keeps the records off each other's cache lines
+};
+struct jlimbo {
+	struct jlimbo* next;
+	unsigned long epoch;
+	void* p;
+	void (*fn)(void*);
+};
+#define JLIMBO_BATCH 64
+static struct jthread* jthreads;	//records are reused, never freed
+static jmutex jthreadslock = JMUTEX_INIT;
+static pthread_key_t jthreadkey;
+static pthread_once_t jthreadonce = PTHREAD_ONCE_INIT;
+static _Thread_local struct jthread* jme;
+static unsigned long jepoch = 1;
+static struct jlimbo* limbo;
+static unsigned int limbonum;
+static jmutex limbolock = JMUTEX_INIT;
+
+static void jthread_gone(void* arg) {
+	struct jthread* me = (struct jthread*)arg;
+	jsetrel(me->epoch, 0UL);
+	jmx_lock(&jthreadslock);
+	me->inuse = 0;
+	jmx_unlock(&jthreadslock);
+}
+static void jthread_keymake(void) {
+	pthread_key_create(&jthreadkey, jthread_gone);
+}
+/**@return this thread's record, NULL when out of memory*/
+static struct jthread* jthread_self(void) {
+	struct jthread* me = jme;
+	if (me)
+		return me;
+	pthread_once(&jthreadonce, jthread_keymake);
+	jmx_lock(&jthreadslock);
+	for (me = jthreads; me; me = me->next)
+		if (!me->inuse) break;
+	if (!me) {
+		me = (struct jthread*)calloc(1, sizeof(struct jthread));
+		if (!me) {
+			jmx_unlock(&jthreadslock);
+			return NULL;
+		}
+		me->next = jthreads;
+		jthreads = me;
+	}
+	me->inuse = 1;
+	me->nest = 0;
+	jmx_unlock(&jthreadslock);
+	pthread_setspecific(jthreadkey, me);
+	jme = me;
+	return me;
+}
+/**@return NULL if the thread could not be registered, the caller must then lock*/
+static struct jthread* epoch_enter(void) {
+	struct jthread* me = jthread_self();
+	if (me && me->nest++ == 0) {
+		jset(me->epoch, jget(jepoch));
+		jfence_full();
+	}
+	return me;
+}
+static void epoch_leave(struct jthread* me) {
+	if (me && --me->nest == 0)
+		jsetrel(me->epoch, 0UL);
+}
+/**moves the epoch on if every reader inside has seen the current one, limbolock held*/
+static void epoch_try_advance(void) {
+	struct jthread* t;
+	unsigned long g = jget(jepoch);
+	jfence_full();
+	jmx_lock(&jthreadslock);
+	for (t = jthreads; t; t = t->next) {
+		unsigned long e = jgetacq(t->epoch);
+		if (e != 0 && e != g) {
+			jmx_unlock(&jthreadslock);
+			return;
+		}
+	}
+	jmx_unlock(&jthreadslock);
+	jsetrel(jepoch, g + 1);
+}
+/**frees whatever was retired two or more epochs ago*/
+static void epoch_reclaim(int force) {
+	struct jlimbo* done = NULL;
+	struct jlimbo** pp;
+	unsigned long g;
+	jmx_lock(&limbolock);
+	if (!force && limbonum < JLIMBO_BATCH) {
+		jmx_unlock(&limbolock);
+		return;
+	}
+	epoch_try_advance();
+	g = jget(jepoch);
+	for (pp = &limbo; *pp; ) {
+		struct jlimbo* l = *pp;
+		if (l->epoch + 2 <= g) {
+			*pp = l->next;
+			l->next = done;
+			done = l;
+			limbonum--;
+		}
+		else pp = &l->next;
+	}
+	jmx_unlock(&limbolock);
+	while (done) {
+		struct jlimbo* l = done;
+		done = l->next;
+		l->fn(l->p);
+		free(l);
+	}
+}
+/**frees p with fn once no lookup can still be looking at it*/
+static void epoch_retire(void* p, void (*fn)(void*)) {
+	struct jlimbo* l = (struct jlimbo*)malloc(sizeof(struct jlimbo));
+	if (!l) {
+		/*--no memory to queue it: wait the readers out instead--*/
+		unsigned long target;
+		jfence_full();
+		jmx_lock(&limbolock);
+		target = jget(jepoch) + 2;
+		while (jget(jepoch) < target) {
+			jmx_unlock(&limbolock);
+			sched_yield();
+			jmx_lock(&limbolock);
+			epoch_try_advance();
+		}
+		jmx_unlock(&limbolock);
+		fn(p);
+		return;
+	}
+	l->p = p;
+	l->fn = fn;
+	jfence_full();	//the unlink is seen before the epoch is read
+	jmx_lock(&limbolock);
+	l->epoch = jget(jepoch);
+	l->next = limbo;
+	limbo = l;
+	limbonum++;
+	jmx_unlock(&limbolock);
+	epoch_reclaim(0);
+}
+#else
+#define jget(x)        (x)
+#define jset(x, v)     ((x) = (v))
+#define jgetacq(x)     (x)
+#define jsetrel(x, v)  ((x) = (v))
+#define jfence_acq()   ((void)0)
+#define jfence_rel()   ((void)0)
+#define jfence_full()  ((void)0)
+#define jadd(x, v)     ((x) += (v))
+struct jthread {
+	unsigned long hits;
+	unsigned long misses;
+#ifndef JAMRAMFS_NO_STATS
+	struct jstats st;
+#endif
+	int finding;
 };
-static struct jamrampath* jammies;
+static struct jthread jthreadonly;
+#define jthread_self()       (&jthreadonly)
+#define epoch_enter()        (&jthreadonly)
+#define epoch_leave(me)      ((void)(me))
+#define epoch_retire(p, fn)  ((fn)(p))
+#endif
+
+/*--
+ find callbacks run with directories or namelock held shared, so a
+ change made from one would wait on itself: it is refused instead
+--*/
+static int find_enter(void) {
+	struct jthread * me = jthread_self();
+	int was;
+	if (me == NULL)
+		return 0;
+	was = me->finding;
+	me->finding = 1;
+	return was;
+}
+static void find_leave(int was) {
+	struct jthread * me = jthread_self();
+	if (me != NULL)
+		me->finding = was;
+}
+static int in_find(void) {
+	struct jthread * me = jthread_self();
+	return me != NULL && me->finding;
+}
+
+//####################################################################################
+
+#ifndef JAMRAMFS_NO_STATS
+/**@return ns on a clock that should not jump*/
+static uint64_t stat_begin(void) {
+	struct timespec ts;
+#if defined(CLOCK_MONOTONIC)
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+#elif defined(TIME_MONOTONIC)
+	timespec_get(&ts, TIME_MONOTONIC);
+#else
+	timespec_get(&ts, TIME_UTC);	// no monotonic clock here: a step of the wall clock skews one sample
+#endif
+	return (uint64_t) ts.tv_sec * 1000000000u + (uint64_t) ts.tv_nsec;
+}
+
+/**@return 0 for 0, else 1 + the highest set bit, at most nb - 1*/
+static int stat_bucket(uint64_t v, int nb) {
+	int b = 0;
+	while (v != 0 && b < nb - 1) {
+		v >>= 1;
+		b++;
+	}
+	return b;
+}
+
+/**one more call of op, which started at t0; the thread's record alone is written*/
+static void stat_end(int op, uint64_t t0) {
+	struct jthread * me = jthread_self();
+	uint64_t t = stat_begin();
+	unsigned long * h;
+	if (me == NULL)
+		return;
+	h = &me->st.lat[op][stat_bucket(t > t0 ? t - t0 : 0, JST_LAT)];
+	jset(me->st.calls[op], me->st.calls[op] + 1);
+	jset(*h, *h + 1);
+}
+
+/**a lookup that walked depth components*/
+static void stat_walk(unsigned int depth) {
+	struct jthread * me = jthread_self();
+	unsigned long * h;
+	if (me == NULL)
+		return;
+	h = &me->st.depth[depth < JST_DEPTH ? depth : JST_DEPTH - 1];
+	jset(*h, *h + 1);
+}
+
+/**one component looked up among its siblings in probes slots*/
+static void stat_scan(unsigned int probes) {
+	struct jthread * me = jthread_self();
+	unsigned long * h;
+	if (me == NULL)
+		return;
+	h = &me->st.scan[probes < JST_SCAN ? probes : JST_SCAN - 1];
+	jset(*h, *h + 1);
+}
+
+/**resident nodes and content bytes went up (or down) by this much*/
+static void stat_mem(long nodes, long bytes) {
+	struct jthread * me = jthread_self();
+	if (me == NULL)
+		return;
+	jset(me->st.nodes, me->st.nodes + nodes);
+	jset(me->st.bytes, me->st.bytes + bytes);
+}
+#else
+#define stat_begin()             ((uint64_t) 0)
+#define stat_end(op, t0)         ((void)(t0))
+#define stat_walk(depth)         ((void)(depth))
+#define stat_scan(probes)        ((void)(probes))
+#define stat_mem(nodes, bytes)   ((void)0)
+#endif
+
+/*--small allocations: size classes carved from big blocks, with free lists--*/
+#define ARENA_BLOCK   (64*1024)
+#define ARENA_MINSZ   16
+#define ARENA_CLASSES 9	//16 .. 4096, bigger goes straight to malloc
+static void* arenafree[ARENA_CLASSES];
+static char* arenabump;
+static size_t arenaleft;
+static jmutex arenalock = JMUTEX_INIT;
+static int arena_class(size_t n) {
+	int c = 0;
+	size_t sz = ARENA_MINSZ;
+	while (sz < n) {
+		sz <<= 1;
+		c++;
+	}
+	return c;
+}
 /**
-  - if Return value < 0 then it indicates str1 is less than str2.
-  - if Return value > 0 then it indicates str2 is less than str1.
-  - if Return value = 0 then it indicates str1 is equal to str2.
+ for names, paths and other short lived small records
+ @return NULL when out of memory
 */
-static int jamcmp(const void* a, const void* b) {
-	struct jamrampath* x = (struct jamrampath*)a;
-	struct jamrampath* y = (struct jamrampath*)b;
-	/*--we want NULL paths to always sort to the rear--*/
-	if (x->path == y->path) return 0; //null AND identical string pointers
-	if (!x->path) return -1;
-	if (!y->path) return 1;
-	return strcmp(x->path, y->path);
+static void* arena_alloc(size_t n) {
+	void* p;
+	int c;
+	size_t sz;
+	if (n > (size_t)ARENA_MINSZ << (ARENA_CLASSES - 1))
+		return malloc(n);
+	c = arena_class(n);
+	sz = (size_t)ARENA_MINSZ << c;
+	jmx_lock(&arenalock);
+	if (arenafree[c]) {
+		p = arenafree[c];
+		arenafree[c] = *(void**)p;
+		jmx_unlock(&arenalock);
+		return p;
+	}
+	if (arenaleft < sz) {
+		/*--hand the tail of the old block to the free lists, then start a new one--*/
+		while (arenaleft >= ARENA_MINSZ) {
+			int k = arena_class(arenaleft);
+			if (((size_t)ARENA_MINSZ << k) > arenaleft) k--;
+			*(void**)arenabump = arenafree[k];
+			arenafree[k] = arenabump;
+			arenabump += (size_t)ARENA_MINSZ << k;
+			arenaleft -= (size_t)ARENA_MINSZ << k;
+		}
+		arenabump = (char*)malloc(ARENA_BLOCK);
+		if (!arenabump) {
+			arenaleft = 0;
+			jmx_unlock(&arenalock);
+			return NULL;
+		}
+		arenaleft = ARENA_BLOCK;
+	}
+	p = arenabump;
+	arenabump += sz;
+	arenaleft -= sz;
+	jmx_unlock(&arenalock);
+	return p;
+}
+/**@param n the same size that was given to arena_alloc()*/
+static void arena_free(void* p, size_t n) {
+	int c;
+	if (!p) return;
+	if (n > (size_t)ARENA_MINSZ << (ARENA_CLASSES - 1)) {
+		free(p);
+		return;
+	}
+	c = arena_class(n);
+	jmx_lock(&arenalock);
+	*(void**)p = arenafree[c];
+	arenafree[c] = p;
+	jmx_unlock(&arenalock);
 }
-int jkdir(const char* filename, int mode) {
-	struct jamrampath keyla;
-	struct jamrampath* n;
-	size_t i;
 
-	if (!jammies) {
-		jammies = malloc(sizeof(struct jamrampath) * 10);
-		if (!jammies)
-			return -1;
-		numPaths = 10;
+//####################################################################################
+
+/**FNV-1a over the first len bytes, of a resource name or a journal record*/
+static unsigned int kid_hash(const char * name, size_t len) {
+	unsigned int h = 2166136261u;
+	while (len--) {
+		h ^= (unsigned char) *name++;
+		h *= 16777619u;
 	}
-	keyla.path = (char*) filename;
-	n = (struct jamrampath*)bsearch(&keyla,
-		jammies, numPaths, sizeof(struct jamrampath), &jamcmp);
-	if (n)
+	return h;
+}
+
+//####################################################################################
+
+/*--
+ journal: once jfs_journal_open() has run, every create(), write_file(),
+ delete(), jfs_delete_r() (async and parallel too), jfs_clone(), jkdir()
+ and jremove() that changes something appends a record to a log file,
+ and returns only once that record is on disk. The record is added
+ while the change still holds its locks, so the log has dependent
+ changes in the order they happened; the write and fsync() come after,
+ by whichever waiting thread gets there first, for everything added so
+ far (group commit). Each change holds jnwlock shared, so a compaction
+ or a jfs_clone() can take it exclusive and see no change half done.
+ A record is: u32 payload length, u32 FNV-1a of the payload, then op,
+ num, path a, path b (each length and bytes and a '\0'), data.
+--*/
+#ifndef JFS_JOURNAL_COMPACT
+#define JFS_JOURNAL_COMPACT (64UL << 20)	// log bytes that trigger a compaction
+#endif
+
+enum { JOP_CREATE = 1, JOP_WRITE, JOP_DELETE, JOP_DELETE_R, JOP_MKDIR, JOP_REMOVE, JOP_CLONE };
+
+static int jnon;				// a journal is open, only ever set in a JAMRAMFS_JOURNAL build
+
+#ifdef JAMRAMFS_JOURNAL
+static jrwlock jnwlock = JRWLOCK_INIT;
+static jmutex jnlock = JMUTEX_INIT;	// the rest, taken after any node lock
+#ifdef JAMRAMFS_THREADS
+static pthread_cond_t jnsynced_cv = PTHREAD_COND_INITIALIZER;
+#endif
+static int jnfd = -1;
+static char * jnpath;			// the log; the snapshot is jnpath.snap
+static uint32_t jngen;			// bumped by each compaction, the snapshot's tag
+static char * jnbuf;			// added, not yet written
+static size_t jnlen, jncap;
+static char * jnspare;			// the other buffer, swapped in while jnbuf is being written
+static size_t jnsparecap;
+static uint64_t jnadded;		// bytes ever added
+static uint64_t jnsynced;		// of these, the ones on disk
+static int jnbusy;				// a thread is writing and syncing
+static int jnerr;				// a write failed, the log is no good from here on
+static uint64_t jnsize;			// of the log file
+static int jncompacting;
+
+/**
+ @return 1 if jnwlock was taken, 0 with no journal open, -1 if the log
+ already failed or a find callback is making the change: the change
+ must not be made. Handed to journal_leave().
+*/
+static int journal_enter(int excl) {
+	int err;
+	if (in_find())
 		return -1;
-	/*--if any are empty they will be at the end--*/
-	for (i = numPaths-1; i > numPaths-3; --i) {
-		if (jammies[i].status == jamrampath_FREE) {
-			jammies[i].path = malloc(strlen(filename) + 1);
-			if (!jammies[i].path)
-				return -1;
-			jammies[i].status = jamrampath_DIR;
-			strcpy(jammies[i].path, filename);
-			qsort(jammies, numPaths, sizeof(struct jamrampath), &jamcmp);
+	if (!jgetacq(jnon))
+		return 0;
+	if (excl)
+		jrw_wr(&jnwlock);
+	else
+		jrw_rd(&jnwlock);
+	jmx_lock(&jnlock);
+	err = jnerr;
+	jmx_unlock(&jnlock);
+	if (err) {
+		jrw_unlock(&jnwlock);
+		return -1;
+	}
+	return 1;
+}
+
+static void journal_put(char ** p, const void * d, size_t n) {
+	memcpy(*p, d, n);
+	*p += n;
+}
+
+/**
+ adds one record; the caller still holds the locks of its change.
+ A record that cannot be added leaves the log failed, which
+ journal_leave() then reports.
+ @return what journal_leave() is to wait for, 0 if nothing was added
+*/
+static uint64_t journal_add(int op, const char * a, const char * b, const void * d, size_t dlen, long num) {
+	uint32_t al = a ? (uint32_t) strlen(a) : 0;
+	uint32_t bl = b ? (uint32_t) strlen(b) : 0;
+	uint64_t dl = dlen;
+	int64_t n = num;
+	unsigned char o = (unsigned char) op;
+	size_t sz = 8 + 1 + 8 + 4 + al + 1 + 4 + bl + 1 + 8 + dlen;
+	uint32_t len, sum;
+	uint64_t lsn;
+	char * p;
+	char * rec;
+
+	jmx_lock(&jnlock);
+	if (!jnon || jnerr) {
+		jmx_unlock(&jnlock);
+		return 0;
+	}
+	if (sz - 8 > UINT32_MAX) {		// too big for one record, so the log falls behind
+		jnerr = 1;
+		jmx_unlock(&jnlock);
+		return 0;
+	}
+	if (jnlen + sz > jncap) {
+		size_t cap = jncap ? jncap : 4096;
+		char * nb;
+		while (cap < jnlen + sz)
+			cap *= 2;
+		nb = (char *) realloc(jnbuf, cap);
+		if (nb == NULL) {
+			jnerr = 1;
+			jmx_unlock(&jnlock);
 			return 0;
 		}
+		jnbuf = nb;
+		jncap = cap;
 	}
-	/*--no free paths, malloc some--*/
-	{
-		void* newjam = realloc(jammies, numPaths + 100);
-		if (!newjam) return -1;
-		jammies = (struct jamrampath*)newjam;
-		memset(&jammies[numPaths], 0, sizeof(struct jamrampath) * 100);
-	}
-	numPaths += 100;
-	/*--if any are empty they will be at the end--*/
-	for (i = numPaths - 1; i > numPaths - 3; --i) {
-		if (jammies[i].status == jamrampath_FREE) {
-			jammies[i].path = malloc(strlen(filename) + 1);
-			if (!jammies[i].path)
-				return -1;
-			jammies[i].status = jamrampath_DIR;
-			strcpy(jammies[i].path, filename);
-			qsort(jammies, numPaths, sizeof(struct jamrampath), &jamcmp);
-			return 0;
+	rec = p = jnbuf + jnlen;
+	p += 8;
+	journal_put(&p, &o, 1);
+	journal_put(&p, &n, 8);
+	journal_put(&p, &al, 4);
+	journal_put(&p, al ? a : "", al + 1);
+	journal_put(&p, &bl, 4);
+	journal_put(&p, bl ? b : "", bl + 1);
+	journal_put(&p, &dl, 8);
+	if (dlen)
+		journal_put(&p, d, dlen);
+	len = (uint32_t)(sz - 8);
+	sum = kid_hash(rec + 8, len);
+	memcpy(rec, &len, 4);
+	memcpy(rec + 4, &sum, 4);
+	jnlen += sz;
+	jnadded += sz;
+	lsn = jnadded;
+	jmx_unlock(&jnlock);
+	return lsn;
+}
+
+static int journal_write(int fd, const char * p, size_t n) {
+	while (n) {
+		ssize_t w = write(fd, p, n);
+		if (w < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
 		}
+		p += w;
+		n -= (size_t) w;
 	}
-	return -1;
+	return 0;
 }
-int jremove(const char* const path) {
-	if (jammies) {
-		struct jamrampath keyla;
-		struct jamrampath* n;
-		keyla.path = (char*) path;
-		n = (struct jamrampath*)bsearch(&keyla,
-			jammies, numPaths, sizeof(struct jamrampath), &jamcmp);
-		if (!n)
-			return -1;
-		if (n->status == jamrampath_DIR) {
-			/*--remove a dir, remove all that share the prefix--*/
-			size_t i;
-			size_t nlen = strlen(path);
-			for (i = 0; i < numPaths; ++i) {
-				if (jammies[i].status == jamrampath_FREE) continue;
-				if (jammies[i].path == NULL) continue;
-				if (jammies[i].status == jamrampath_FILE_ALREADY_OPEN) continue;
-
-				if (strncmp(path, jammies[i].path, nlen) == 0
-				&& (jammies[i].path[nlen]=='/'
-				|| jammies[i].path[nlen]=='\\')) {
-					if (jammies[i].status == jamrampath_DIR) {
-						/*--we should not need to handle this specially--*/
-					}
-					free(jammies[i].path);
-					if(jammies[i].filedata)
-						free(jammies[i].filedata);
-					memset(&jammies[i], 0, sizeof(struct jamrampath));
-				}
-			}
-			qsort(jammies, numPaths, sizeof(struct jamrampath), &jamcmp);
-			return 0;
+
+/**
+ waits until the log is on disk up to lsn; if no one is writing, this
+ thread writes and syncs all that was added, for everyone. jnlock held.
+*/
+static void journal_sync_locked(uint64_t lsn) {
+	while (jnsynced < lsn && !jnerr) {
+		char * buf;
+		size_t len, cap;
+		uint64_t upto;
+		int ok;
+		if (jnbusy) {
+#ifdef JAMRAMFS_THREADS
+			pthread_cond_wait(&jnsynced_cv, &jnlock);
+#endif
+			continue;
 		}
-		else {
-			if (n->status == jamrampath_FILE_ALREADY_OPEN)
-				return -1;
-			free(n->path);
-			if (n->filedata)
-				free(n->filedata);
-			memset(n, 0, sizeof(struct jamrampath));
-			qsort(jammies, numPaths, sizeof(struct jamrampath), &jamcmp);
-			return 0;
+		buf = jnbuf;
+		cap = jncap;
+		len = jnlen;
+		upto = jnadded;
+		jnbuf = jnspare;
+		jncap = jnsparecap;
+		jnlen = 0;
+		jnbusy = 1;
+		jmx_unlock(&jnlock);
+		ok = journal_write(jnfd, buf, len) == 0 && fsync(jnfd) == 0;
+		jmx_lock(&jnlock);
+		jnspare = buf;
+		jnsparecap = cap;
+		jnbusy = 0;
+		if (ok) {
+			jnsynced = upto;
+			jnsize += len;
 		}
+		else
+			jnerr = 1;
+#ifdef JAMRAMFS_THREADS
+		pthread_cond_broadcast(&jnsynced_cv);
+#endif
 	}
-	return -1;
 }
-/**pays attention to J_CREAT and J_TRUNC only */
-struct jamrampath* jfallbackOpen(const char* path, int mode) {
-	struct jamrampath* node;
-	struct jamrampath keyla;
-	keyla.path = (char*)path;
-	node = bsearch(&keyla, jammies, numPaths, sizeof(struct jamrampath), &jamcmp);
-	if (!node)
-		return NULL;
-	if (node->status != jamrampath_FILE)
-		return NULL;
-	node->status = jamrampath_FILE_ALREADY_OPEN;
-	return node;
+
+/**@return all that has been added so far, for journal_leave()*/
+static uint64_t journal_tail(void) {
+	uint64_t r;
+	jmx_lock(&jnlock);
+	r = jnadded;
+	jmx_unlock(&jnlock);
+	return r;
 }
-void jfallbackClose(struct jamrampath* node) {
-	node->status = jamrampath_FILE;
-	return;
+
+/**
+ lets go of jnwlock, then waits for lsn to be on disk and compacts the log if it has grown
+ @return 0 okay, -1 if the change is not in the log: it did not get there, or was not let in
+*/
+static int journal_leave(int held, uint64_t lsn) {
+	int compact, r;
+	if (held <= 0)
+		return held;
+	jrw_unlock(&jnwlock);
+	jmx_lock(&jnlock);
+	if (lsn == 0) {		// nothing to log, or it could not be added
+		r = jnerr ? -1 : 0;
+		jmx_unlock(&jnlock);
+		return r;
+	}
+	journal_sync_locked(lsn);
+	r = jnsynced < lsn ? -1 : 0;
+	compact = !jnerr && !jncompacting && jnsize > JFS_JOURNAL_COMPACT;
+	if (compact)
+		jncompacting = 1;
+	jmx_unlock(&jnlock);
+	if (compact)
+		jfs_journal_compact();
+	return r;
+}
+#else
+#define journal_enter(excl)                 ((void)(excl), in_find() ? -1 : 0)
+#define journal_add(op, a, b, d, dlen, num) ((void)(d), (uint64_t) 0)
+#define journal_tail()                      ((uint64_t) 0)
+#define journal_leave(held, lsn)            ((void)(held), (void)(lsn), 0)
+#endif
+
+//####################################################################################
+
+#define jamrampath_FREE 0
+#define jamrampath_FILE 1
+#define jamrampath_DIR  2
+#define jamrampath_FILE_ALREADY_OPEN 3
+/**what jfallbackOpen() hands out: a file of the tree, held like a jmap() view*/
+struct jamrampath{
+	char* path;
+	char* filedata;
+	size_t filesize;
+	int status;
+};
+/**
+ compares path against the key[0..klen) followed by next,
+ or just key[0..klen) when next is '\0'
+  - if Return value < 0 then it indicates path is less than the key.
+  - if Return value > 0 then it indicates the key is less than path.
+  - if Return value = 0 then it indicates path is equal to the key.
+*/
+static int jamcmp(const char* path, const char* key, size_t klen, char next) {
+	int c = strncmp(path, key, klen);
+	if (c) return c;
+	return (int)(unsigned char)path[klen] - (int)(unsigned char)next;
 }
 
 #define PATH_L             255
 #define PATH_STRING_L      65280+1   // altezza albero 255, lunghezza nomi risorse 255 e 255 slashes
 #define NAME_L             255+1
 #define DATA_L             255+1
-#define MAX_SONS           1024
+#define MAX_SONS           (1 << 28)	// sons are hashed, this only keeps kidscap in an unsigned int
 #define DIR_T              'D'
 #define FILE_T             'F'
 #define CMD_L              10+1              // il piu' lungo e' create_dir --> 10+1 caratteri
@@ -176,396 +756,4436 @@ void jfallbackClose(struct jamrampath* node) {
 typedef enum { true, false } boolean;
 
 struct result {
-	char p[PATH_STRING_L];
 	struct result * next;
+	char p[1];		// allocated to the path length
 };
 
 typedef struct res {
 	char type;
-	char name[NAME_L];
+	char * name;		// allocated to the name length
 	//char path[PATH_STRING_L];
-	char data[DATA_L];
+	char * data;		// file content, binary safe, NULL until written
+	size_t datasz;
+	size_t datacap;
 	struct res * son;
 	struct res * bro;
 	struct res * prev;
 	struct res * father;
 	int sonsnum;
+	/*--children by name: open addressing, linear probing, power of two--*/
+	struct res ** kids;
+	unsigned int kidscap;
+	unsigned int hash;
+	struct res * lastson;
+	struct pcent * pcent;	// entry in the full path cache, if any
+	int opens;				// JILE descriptors bound to this file
+	int maps;				// live jmap() views, data must not move
+	int dead;				// unlinked, kept only for lock free readers
+	int pins;				// queued by a parallel walk, must not be deleted
+	struct nament * nament;	// entry in the basename index, NULL for the root
+	struct res * namenext;	// other resources with the same name
+	struct res * nameprev;
+	unsigned int seq;		// odd while kids or content are being changed
+	unsigned int img;		// 1 + its record in the mounted image, 0 if it has none
+	struct jshare * share;	// content shared with clones, see share_with()
+	struct jexttab * ext;	// content in extents rather than data, see data_reserve()
+	/*--
+	 guards the node's own fields and, for a directory, its children's
+	 son/bro/prev links and the kids table; always taken parent first
+	--*/
+	jrwlock lock;
 } node;
 
 node * root;   		  	    // radice dell'albero
 struct result * results;    // lista di risultati della find
+static jmutex resultslock = JMUTEX_INIT;
+
+//####################################################################################
+
+/*--node records come from slabs, freed ones are kept on a list for reuse--*/
+#define NODE_SLAB 256
+static node * nodefree;
+static jmutex nodelock = JMUTEX_INIT;
+
+static node * node_alloc(void) {
+	node * T;
+	jmx_lock(&nodelock);
+	if (nodefree == NULL) {
+		int i;
+		node * slab = (node *) malloc(sizeof(node) * NODE_SLAB);
+		if (slab == NULL) {
+			jmx_unlock(&nodelock);
+			return NULL;
+		}
+		for (i = 0; i < NODE_SLAB; i++) {
+			slab[i].bro = nodefree;
+			nodefree = &slab[i];
+		}
+	}
+	T = nodefree;
+	nodefree = T->bro;
+	jmx_unlock(&nodelock);
+	return T;
+}
+
+static void node_free(node * T) {
+	jmx_lock(&nodelock);
+	T->bro = nodefree;
+	nodefree = T;
+	jmx_unlock(&nodelock);
+}
 
 //####################################################################################
 
 node * create_element(node *T, node *F, char *name, char res_type) {
 	//int i;// , l;
-	T = (node *) malloc(sizeof(node));
+	size_t l = strlen(name);
+	T = node_alloc();
 	if (T == NULL) {
 		return NULL;
 	}
+	T->name = (char *) arena_alloc(l + 1);
+	if (T->name == NULL) {
+		node_free(T);
+		return NULL;
+	}
 	T->sonsnum = 0;
 	T->type = res_type;
-	strcpy(T->data, "");
+	T->data = NULL;
+	T->datasz = 0;
+	T->datacap = 0;
 	//T->path = (char *) malloc(sizeof(char) * strlen(path));
 	//strcpy(T->path, path);
-	//T->name = (char *)malloc(sizeof(char) * strlen(name));
-	strcpy(T->name, name);
+	memcpy(T->name, name, l + 1);
 	T->father = F;
 	T->son = NULL;
 	T->bro = NULL;
 	T->prev = NULL;
+	T->kids = NULL;
+	T->kidscap = 0;
+	T->hash = kid_hash(name, l);
+	T->lastson = NULL;
+	T->pcent = NULL;
+	T->opens = 0;
+	T->maps = 0;
+	T->dead = 0;
+	T->pins = 0;
+	T->nament = NULL;
+	T->namenext = NULL;
+	T->nameprev = NULL;
+	T->seq = 0;
+	T->img = 0;
+	T->share = NULL;
+	T->ext = NULL;
+	jrw_init(&T->lock);
+	stat_mem(1, 0);
 
 	return T;
 }
 
-//####################################################################################
+/*--
+ clones share file contents: the buffer moves into a counted jshare,
+ every sharer keeps no capacity of its own, and data_reserve() gives
+ a sharer a private copy on its first write
+--*/
+struct jshare {
+	long refs;
+	char * data;
+	size_t cap;		// what the buffer was allocated to, for the stats
+};
 
-void extract_name(const char * path, char * name) {
-	int i, l;
-	l = (int) strlen(path);
-	i = l - 1;
-	while (path[i] != '/') {
-		i--;
+static void share_put(void * p) {
+	struct jshare * sh = (struct jshare *) p;
+	if (jadd(sh->refs, -1) == 0) {
+		stat_mem(0, -(long) sh->cap);
+		free(sh->data);
+		free(sh);
 	}
-	if (strlen(path)-i > NAME_L)
-		strcpy(name, "");
-	else
-		strcpy(name, &path[i+1]);
 }
 
-//####################################################################################
+/*--
+ a file that grows past JFS_EXTENT bytes moves its content into fixed
+ size extents, so growing it further copies no data: only the table
+ of extents is ever moved, one pointer per extent. A slot left NULL is
+ a hole, backed by nothing and read as zero. Extents are counted, so
+ clones share them, and a write to a shared one copies just that one.
+ Bytes past the file size in an extent are always zero.
+--*/
+#ifndef JFS_EXTENT
+#define JFS_EXTENT (64*1024)	// a power of two
+#endif
+struct jextent {
+	long refs;
+	char d[JFS_EXTENT];
+};
+struct jexttab {
+	size_t n;					// slots
+	struct jextent * e[1];		// allocated to n
+};
+static char jzero[JFS_EXTENT];	// what a hole holds; never written, so it stays the system's zero page
 
-int calc_path_length(char * s) {
-	int i, k = 0;
-	for (i = 0; s[i] != '\0'; i++) {
-		if (s[i] == '/') {
-			k = k + 1;
-		}
+static void ext_put(void * p) {
+	struct jextent * x = (struct jextent *) p;
+	if (jadd(x->refs, -1) == 0) {
+		stat_mem(0, -(long) JFS_EXTENT);
+		free(x);
 	}
-	return k;
 }
 
-//####################################################################################
-
-node * path_travel(char * path) {
+/**frees what T holds, not T itself*/
+static void node_release(node * T) {
+	jrw_destroy(&T->lock);
+	free(T->kids);
+	if (T->ext != NULL) {
+		size_t i;
+		for (i = 0; i < T->ext->n; i++)
+			if (T->ext->e[i] != NULL)
+				ext_put(T->ext->e[i]);
+		free(T->ext);
+	}
+	else if (T->share != NULL)
+		share_put(T->share);
+	else if (T->datacap != 0) {	// else none, or still the mounted image's
+		stat_mem(0, -(long) T->datacap);
+		free(T->data);
+	}
+	stat_mem(-1, 0);
+	arena_free(T->name, strlen(T->name) + 1);
+}
 
-	node * t;
-	char * token;
-	char temp_path[PATH_STRING_L];
-	int i = 0;
-	boolean found = false;
+static void node_reclaim(void * p) {
+	node_release((node *) p);
+	node_free((node *) p);
+}
 
-	t = root;
+/**freed once no lock free reader can still be on it*/
+void destroy_element(node * T) {
+	epoch_retire(T, node_reclaim);
+}
 
-	strcpy(temp_path, path);
-	token = strtok(temp_path, "/");
+/*--subtree removal frees its nodes in batches, one retire and one trip to the slab list each--*/
+#define NODE_BATCH 64
+struct nodebatch {
+	int n;
+	node * v[NODE_BATCH];
+};
 
-	while (token != NULL) {  // come fare i < path_length  // questo ciclo sposta t fino al penultimo pezzo di percorso
-		found = false;
-		if (t->son != NULL)
-			t = t->son;
-		else {
-			return NULL;
-		}
-		if (strcmp(token, t->name) == 0)
-			found = true;
+static void node_reclaim_batch(void * p) {
+	struct nodebatch * b = (struct nodebatch *) p;
+	int i;
+	for (i = 0; i < b->n; i++)
+		node_release(b->v[i]);
+	jmx_lock(&nodelock);
+	for (i = 0; i < b->n; i++) {
+		b->v[i]->bro = nodefree;
+		nodefree = b->v[i];
+	}
+	jmx_unlock(&nodelock);
+	free(b);
+}
 
-		while (t->bro != NULL && found == false) {
-			t = t->bro;
-			if (strcmp(token, t->name) == 0)
-				found = true;
-		}
+static void batch_flush(struct nodebatch ** b) {
+	if (*b != NULL)
+		epoch_retire(*b, node_reclaim_batch);
+	*b = NULL;
+}
 
-		if (found == false)   {  // non ho trovato la risorsa cercata
-			return NULL;
+static void batch_add(struct nodebatch ** b, node * T) {
+	if (*b == NULL) {
+		*b = (struct nodebatch *) malloc(sizeof(struct nodebatch));
+		if (*b == NULL) {
+			destroy_element(T);
+			return;
 		}
-
-		token = strtok(NULL, "/");
+		(*b)->n = 0;
 	}
-	
-	return t;
-
+	(*b)->v[(*b)->n++] = T;
+	if ((*b)->n == NODE_BATCH)
+		batch_flush(b);
 }
 
-//####################################################################################
+/*--
+ seqcount: odd while a writer, holding the node exclusive, changes its
+ kids table or content, so a lock free reader can tell and go again
+--*/
+static void seq_write_begin(node * T) {
+	jset(T->seq, T->seq + 1);
+	jfence_rel();
+}
 
-enum returnCode create(char * name, char * path, int path_length, char res_type) {
+static void seq_write_end(node * T) {
+	jsetrel(T->seq, T->seq + 1);
+}
 
-	node * t;
-	node * new;
-	node * f;
-	char * token;
-	char temp_path[PATH_STRING_L];
-	int i = 0;
-	boolean found = false;
-	boolean free_slot = false;
-	t = root;
-	f = t;
+static unsigned int seq_read_begin(node * T) {
+	unsigned int s;
+	while ((s = jgetacq(T->seq)) & 1)
+		;
+	return s;
+}
 
-	strcpy(temp_path, path);
-	token = strtok(temp_path, "/");
+static int seq_read_retry(node * T, unsigned int s) {
+	jfence_acq();
+	return jget(T->seq) != s;
+}
 
-	new = (node *) malloc(sizeof(node));   	     // alloco nuova risorsa
-	if (new == NULL)
-		return NO;
+/**lets go of T's plain buffer, once no lock free reader can still be copying it*/
+static void data_drop(node * T) {
+	if (T->datacap != 0) {
+		stat_mem(0, -(long) T->datacap);
+		epoch_retire(T->data, free);
+	}
+	else if (T->share != NULL) {	// no capacity: shared with clones, or the mounted image's
+		epoch_retire(T->share, share_put);
+		T->share = NULL;
+	}
+	T->datacap = 0;
+}
 
-	while (i < path_length-1) {    // questo ciclo sposta t fino al penultimo pezzo di percorso
-		found = false;
-		f = t;
-		if (t->son != NULL)
-			t = t->son;
-		if (strcmp(token, t->name) == 0)
-			found = true;
-
-		while(t->bro != NULL && found == false) {
-			t = t->bro;
-			if (strcmp(token, t->name) == 0) {
-				found = true;
-			}
+/**
+ grows T's table of extents to cover need bytes, cutting a plain buffer
+ up into extents first, which is the one copy the content ever gets;
+ a piece that is all zero stays a hole
+ @return 0 okay, -1 out of memory
+*/
+static int ext_reserve(node * T, size_t need) {
+	struct jexttab * old = T->ext;
+	struct jexttab * tab;
+	size_t want = need / JFS_EXTENT + (need % JFS_EXTENT != 0);
+	size_t n = old != NULL ? old->n : 0;
+	size_t i;
+	if (want <= n)
+		return 0;
+	for (n = n ? n : 4; n < want; n *= 2)
+		if (n > ((size_t)-1) / 4 / sizeof(struct jextent *)) {
+			n = want;
+			break;
 		}
-
-		if (found == false)   { // percorso non valido, sto cercando di creare un nodo sotto ad un altro non esistente
-			return NO;
+	tab = (struct jexttab *) malloc(sizeof(struct jexttab) + (n - 1) * sizeof(struct jextent *));
+	if (tab == NULL)
+		return -1;
+	tab->n = n;
+	memset(tab->e, 0, n * sizeof(struct jextent *));
+	if (old != NULL)
+		memcpy(tab->e, old->e, old->n * sizeof(struct jextent *));
+	else for (i = 0; i * JFS_EXTENT < T->datasz; i++) {
+		size_t c = T->datasz - i * JFS_EXTENT < JFS_EXTENT ? T->datasz - i * JFS_EXTENT : JFS_EXTENT;
+		struct jextent * x;
+		if (memcmp(T->data + i * JFS_EXTENT, jzero, c) == 0)
+			continue;		// all zero, as the holes of a saved file come back: left a hole
+		x = (struct jextent *) malloc(sizeof(struct jextent));
+		if (x == NULL) {
+			while (i-- > 0)
+				if (tab->e[i] != NULL)
+					ext_put(tab->e[i]);
+			free(tab);
+			return -1;
 		}
-		else if (found == true && t->type == FILE_T)
-			return NO;
-
-		token = strtok(NULL, "/");
-		i++;
+		x->refs = 1;
+		memcpy(x->d, T->data + i * JFS_EXTENT, c);
+		memset(x->d + c, 0, JFS_EXTENT - c);
+		stat_mem(0, (long) JFS_EXTENT);
+		tab->e[i] = x;
 	}
-
-	if (t->sonsnum == MAX_SONS) {
-		return NO;
+	jsetrel(T->ext, tab);
+	if (old != NULL)
+		epoch_retire(old, free);
+	else {
+		data_drop(T);
+		jsetrel(T->data, (char *) NULL);
 	}
-
-	if (t->son == NULL) {
-		f = t;
-		f->sonsnum++;
-		new = create_element(t, f, name, res_type);
-		t->son = new;
-		new->prev = NULL; // gia' fatto nella create_element
+	return 0;
+}
+
+/**
+ makes room for at least need bytes of content: a plain buffer grows
+ geometrically up to JFS_EXTENT, past that the content goes in extents.
+ T is held exclusive, inside seq_write_begin().
+ @return 0 okay, -1 out of memory
+*/
+static int data_reserve(node * T, size_t need) {
+	size_t newcap;
+	char * newdata;
+	if (T->ext == NULL && need <= T->datacap)
+		return 0;
+	if (T->ext == NULL && T->maps != 0)	// a jmap() view points into the buffer
+		return -1;
+	if (need < T->datasz)	// a shared buffer is copied whole
+		need = T->datasz;
+	if (T->ext != NULL || need > JFS_EXTENT)
+		return ext_reserve(T, need);
+	newcap = T->datacap ? T->datacap : 16;
+	while (newcap < need)
+		newcap *= 2;
+	/*--no realloc(), lock free readers may still be copying the old buffer--*/
+	newdata = (char *) malloc(newcap);
+	if (newdata == NULL)
+		return -1;
+	if (T->datasz)
+		memcpy(newdata, T->data, T->datasz);
+	data_drop(T);
+	jsetrel(T->data, newdata);
+	T->datacap = newcap;
+	stat_mem(0, (long) newcap);
+	return 0;
+}
+
+/**@return slot i of tab made T's own, allocated or unshared, NULL out of memory*/
+static struct jextent * ext_own(struct jexttab * tab, size_t i) {
+	struct jextent * x = tab->e[i];
+	struct jextent * c;
+	if (x != NULL && jget(x->refs) == 1)
+		return x;
+	c = (struct jextent *) malloc(sizeof(struct jextent));
+	if (c == NULL)
+		return NULL;
+	c->refs = 1;
+	if (x != NULL)
+		memcpy(c->d, x->d, JFS_EXTENT);
+	else
+		memset(c->d, 0, JFS_EXTENT);
+	stat_mem(0, (long) JFS_EXTENT);
+	jsetrel(tab->e[i], c);
+	if (x != NULL)
+		epoch_retire(x, ext_put);
+	return c;
+}
+
+/**
+ copies n bytes from src to offset at of T, where data_reserve() has
+ made room; T is held exclusive, inside seq_write_begin()
+ @return 0 okay, -1 out of memory
+*/
+static int data_put(node * T, size_t at, const void * src, size_t n) {
+	const char * p = (const char *) src;
+	if (T->ext == NULL) {
+		if (n)
+			memcpy(T->data + at, p, n);
+		return 0;
+	}
+	while (n != 0) {
+		size_t o = at % JFS_EXTENT;
+		size_t c = JFS_EXTENT - o < n ? JFS_EXTENT - o : n;
+		struct jextent * x = ext_own(T->ext, at / JFS_EXTENT);
+		if (x == NULL)
+			return -1;
+		memcpy(x->d + o, p, c);
+		p += c;
+		at += c;
+		n -= c;
+	}
+	return 0;
+}
+
+/**
+ sets the size of T, held exclusive inside seq_write_begin(), to sz,
+ no more than has been written; in extents a shrink drops the extents
+ past sz and zeroes the last one's tail
+ @return 0 okay, -1 out of memory
+*/
+static int data_trunc(node * T, size_t sz) {
+	struct jexttab * tab = T->ext;
+	if (tab != NULL && sz < T->datasz) {
+		size_t i;
+		for (i = sz / JFS_EXTENT + (sz % JFS_EXTENT != 0); i < tab->n; i++) {
+			struct jextent * x = tab->e[i];
+			if (x != NULL) {
+				jsetrel(tab->e[i], (struct jextent *) NULL);
+				epoch_retire(x, ext_put);
+			}
+		}
+		if (sz % JFS_EXTENT != 0 && tab->e[sz / JFS_EXTENT] != NULL) {
+			struct jextent * x = ext_own(tab, sz / JFS_EXTENT);
+			if (x == NULL)
+				return -1;
+			memset(x->d + sz % JFS_EXTENT, 0, JFS_EXTENT - sz % JFS_EXTENT);
+		}
+	}
+	jset(T->datasz, sz);
+	return 0;
+}
+
+/**
+ grows T, held exclusive inside seq_write_begin(), to sz bytes that
+ read as zero; in extents that is a hole and costs nothing
+ @return 0 okay, -1 out of memory or mapped
+*/
+static int data_extend(node * T, size_t sz) {
+	if (sz <= T->datasz)
+		return 0;
+	if (data_reserve(T, sz) != 0)
+		return -1;
+	if (T->ext == NULL)
+		memset(T->data + T->datasz, 0, sz - T->datasz);
+	jset(T->datasz, sz);
+	return 0;
+}
+
+/**
+ copies n bytes at off out of the content d or tab, both read from one
+ node along with a size that covers them; holes read as zero. Also used
+ lock free, as extents and tables are only ever retired.
+*/
+static void data_copy(const char * d, struct jexttab * tab, size_t off, void * buf, size_t n) {
+	char * p = (char *) buf;
+	if (tab == NULL) {
+		if (n)
+			memcpy(p, d + off, n);
+		return;
+	}
+	while (n != 0) {
+		size_t o = off % JFS_EXTENT;
+		size_t c = JFS_EXTENT - o < n ? JFS_EXTENT - o : n;
+		struct jextent * x = jgetacq(tab->e[off / JFS_EXTENT]);
+		if (x != NULL)
+			memcpy(p, x->d + o, c);
+		else
+			memset(p, 0, c);
+		p += c;
+		off += c;
+		n -= c;
+	}
+}
+
+/**
+ turns [off, off + n) of T, held exclusive inside seq_write_begin(),
+ back into zeros: extents wholly inside become holes and are let go,
+ the ones at the ends are zeroed in part
+ @return 0 okay, -1 out of memory or mapped
+*/
+static int data_punch(node * T, size_t off, size_t n) {
+	size_t end = off + n;
+	if (T->ext == NULL) {
+		if (data_reserve(T, T->datasz) != 0)	// not into a shared buffer
+			return -1;
+		if (T->ext == NULL) {		// unless one past JFS_EXTENT went in extents
+			memset(T->data + off, 0, n);
+			return 0;
+		}
+	}
+	while (off < end) {
+		size_t o = off % JFS_EXTENT;
+		size_t c = JFS_EXTENT - o < end - off ? JFS_EXTENT - o : end - off;
+		struct jextent * x = T->ext->e[off / JFS_EXTENT];
+		if (x != NULL && c == JFS_EXTENT) {
+			jsetrel(T->ext->e[off / JFS_EXTENT], (struct jextent *) NULL);
+			epoch_retire(x, ext_put);
+		}
+		else if (x != NULL) {
+			x = ext_own(T->ext, off / JFS_EXTENT);
+			if (x == NULL)
+				return -1;
+			memset(x->d + o, 0, c);
+		}
+		off += c;
+	}
+	return 0;
+}
+
+/**
+ backs [off, off + n) of T, held exclusive inside seq_write_begin(),
+ with memory of its own, so writing there cannot run out; T grows to
+ off + n if shorter
+ @return 0 okay, -1 out of memory or mapped
+*/
+static int data_alloc(node * T, size_t off, size_t n) {
+	size_t end = off + n;
+	size_t i;
+	if (end < off || data_reserve(T, end) != 0)
+		return -1;
+	if (T->ext != NULL)
+		for (i = off / JFS_EXTENT; i * JFS_EXTENT < end; i++)
+			if (ext_own(T->ext, i) == NULL)
+				return -1;
+	return data_extend(T, end);
+}
+
+/**data_copy() from T, held at least shared*/
+static void data_get(node * T, size_t off, void * buf, size_t n) {
+	data_copy(T->data, T->ext, off, buf, n);
+}
+
+/**
+ puts T's content back from extents into one buffer of its own, for
+ jmap(); T is held exclusive, inside seq_write_begin()
+ @return 0 okay, -1 out of memory
+*/
+static int ext_merge(node * T) {
+	struct jexttab * tab = T->ext;
+	size_t i, cap = T->datasz ? T->datasz : 1;
+	char * d = (char *) malloc(cap);
+	if (d == NULL)
+		return -1;
+	data_copy(NULL, tab, 0, d, T->datasz);
+	stat_mem(0, (long) cap);
+	jsetrel(T->data, d);
+	T->datacap = cap;
+	jsetrel(T->ext, (struct jexttab *) NULL);
+	for (i = 0; i < tab->n; i++)
+		if (tab->e[i] != NULL)
+			epoch_retire(tab->e[i], ext_put);
+	epoch_retire(tab, free);
+	return 0;
+}
+
+/**
+ also used lock free, inside a seq_read_begin() seq_read_retry() pair:
+ kidscap is read before kids and written after it, and only grows,
+ so the mask never reaches past the table being probed
+*/
+static node * kid_probe(node * D, const char * name, size_t len, unsigned int * probes) {
+	unsigned int mask, i;
+	unsigned int h;
+	unsigned int cap;
+	node ** kids;
+	node * k;
+	cap = jgetacq(D->kidscap);
+	kids = jgetacq(D->kids);
+	if (cap == 0)
+		return NULL;
+	h = kid_hash(name, len);
+	mask = cap - 1;
+	for (i = h & mask; (k = jgetacq(kids[i])) != NULL; i = (i + 1) & mask) {
+		(*probes)++;
+		if (k->hash == h && strncmp(k->name, name, len) == 0 && k->name[len] == '\0')
+			return k;
+	}
+	return NULL;
+}
+
+static node * kid_find(node * D, const char * name, size_t len) {
+	unsigned int probes = 0;
+	return kid_probe(D, name, len, &probes);
+}
+
+static int kid_insert(node * D, node * K) {
+	unsigned int mask, i;
+	if ((unsigned int)(D->sonsnum + 1) * 4 > D->kidscap * 3) {
+		/*--grow and rehash, keep the load under 3/4--*/
+		unsigned int newcap = D->kidscap ? D->kidscap * 2 : 8;
+		node ** newkids = (node **) calloc(newcap, sizeof(node *));
+		node ** oldkids;
+		if (newkids == NULL)
+			return -1;
+		mask = newcap - 1;
+		for (i = 0; i < D->kidscap; i++) {
+			node * k = D->kids[i];
+			unsigned int j;
+			if (k == NULL) continue;
+			for (j = k->hash & mask; newkids[j] != NULL; j = (j + 1) & mask);
+			newkids[j] = k;
+		}
+		oldkids = D->kids;
+		jsetrel(D->kids, newkids);
+		jsetrel(D->kidscap, newcap);
+		if (oldkids != NULL)
+			epoch_retire(oldkids, free);
+	}
+	mask = D->kidscap - 1;
+	for (i = K->hash & mask; D->kids[i] != NULL; i = (i + 1) & mask);
+	jsetrel(D->kids[i], K);
+	return 0;
+}
+
+static void kid_remove(node * D, node * K) {
+	unsigned int mask, i, j;
+	if (D->kids == NULL)
+		return;
+	mask = D->kidscap - 1;
+	for (i = K->hash & mask; D->kids[i] != K; i = (i + 1) & mask)
+		if (D->kids[i] == NULL) return;
+	/*--backward shift, so no tombstones are needed--*/
+	for (j = (i + 1) & mask; D->kids[j] != NULL; j = (j + 1) & mask) {
+		unsigned int home = D->kids[j]->hash & mask;
+		if (((j - home) & mask) >= ((j - i) & mask)) {
+			jsetrel(D->kids[i], D->kids[j]);
+			i = j;
+		}
+	}
+	jsetrel(D->kids[i], NULL);
+}
+
+//####################################################################################
+
+void extract_name(const char * path, char * name) {
+	int i, l;
+	l = (int) strlen(path);
+	i = l - 1;
+	while (path[i] != '/') {
+		i--;
+	}
+	if (strlen(path)-i > NAME_L)
+		strcpy(name, "");
+	else
+		strcpy(name, &path[i+1]);
+}
+
+//####################################################################################
+
+int calc_path_length(char * s) {
+	int i, k = 0;
+	for (i = 0; s[i] != '\0'; i++) {
+		if (s[i] == '/') {
+			k = k + 1;
+		}
+	}
+	return k;
+}
+
+//####################################################################################
+
+#ifndef JFS_PATH_CACHE_MAX
+#define JFS_PATH_CACHE_MAX (1<<16)
+#endif
+/**
+ full path -> node cache, so hot files resolve with one probe.
+ Paths are kept canonical ("/a/b", no repeated or trailing slashes)
+ and the query is canonicalised on the fly while hashing/comparing,
+ so a hit does not copy the path anywhere.
+ pcachelock covers the table and every node's pcent field; it is
+ only ever taken after a node lock, never before one.
+ Readers inside an epoch also probe it with no lock at all, so chain
+ links are stored with release, and pcachecap is written after pcache
+ and read before it: a reader never masks past the table it holds.
+*/
+struct pcent {
+	struct pcent * next;
+	node * n;
+	unsigned int hash;
+	char path[1];
+};
+static struct pcent ** pcache;
+static unsigned int pcachecap;
+static unsigned int pcachenum;
+static jrwlock pcachelock = JRWLOCK_INIT;
+
+/**@return the hash, and the canonical length in *len*/
+static unsigned int pcache_hash(const char * path, size_t * len) {
+	unsigned int h = 2166136261u;
+	size_t l = 0;
+	while (*path) {
+		if (*path == '/') {
+			while (*path == '/') path++;
+			if (!*path) break;
+			h ^= '/';
+			h *= 16777619u;
+			l++;
+			continue;
+		}
+		h ^= (unsigned char) *path++;
+		h *= 16777619u;
+		l++;
+	}
+	*len = l;
+	return h;
+}
+
+/**compares a canonical path against any spelling of a path*/
+static int pcache_same(const char * canon, const char * path) {
+	while (*path) {
+		if (*path == '/') {
+			while (*path == '/') path++;
+			if (!*path) break;
+			if (*canon++ != '/') return 0;
+			continue;
+		}
+		if (*canon++ != *path++) return 0;
+	}
+	return *canon == '\0';
+}
+
+/**
+ a cached node may sit in a subtree that has been cut off but not yet
+ torn down, so a hit checks the way up; whatever is on it is still
+ in memory, as a subtree is torn down from the bottom
+*/
+static int node_attached(node * n) {
+	for (; n != root; n = jgetacq(n->father))
+		if (n == NULL || jget(n->dead))
+			return 0;
+	return 1;
+}
+
+/**counted per thread, so a hit does not write anything shared*/
+static void pcache_count(int hit) {
+	struct jthread * me = jthread_self();
+	if (me == NULL)
+		return;
+	if (hit)
+		jset(me->hits, me->hits + 1);
+	else
+		jset(me->misses, me->misses + 1);
+}
+
+/**
+ lock free probe, only inside an epoch. A rehash racing with it can
+ make it miss, never return the wrong node.
+ @return the node, unlocked, or NULL
+*/
+static node * pcache_find(const char * path) {
+	struct pcent ** tab;
+	struct pcent * e;
+	unsigned int cap, h;
+	size_t len;
+	cap = jgetacq(pcachecap);
+	tab = jgetacq(pcache);
+	if (cap != 0) {
+		h = pcache_hash(path, &len);
+		for (e = jgetacq(tab[h & (cap - 1)]); e != NULL; e = jgetacq(e->next)) {
+			if (e->hash == h && pcache_same(e->path, path)) {
+				if (!node_attached(e->n))
+					break;
+				pcache_count(1);
+				return e->n;
+			}
+		}
+	}
+	pcache_count(0);
+	return NULL;
+}
+
+/**
+ @return the node, locked shared or exclusive, or NULL. The node lock is
+ only tried, as pcachelock is held, so a busy node counts as a miss.
+*/
+static node * pcache_lookup(const char * path, int excl) {
+	struct pcent * e;
+	unsigned int h;
+	size_t len;
+	jrw_rd(&pcachelock);
+	if (pcache != NULL) {
+		h = pcache_hash(path, &len);
+		for (e = pcache[h & (pcachecap - 1)]; e != NULL; e = e->next) {
+			if (e->hash == h && pcache_same(e->path, path)) {
+				if (excl ? jrw_trywr(&e->n->lock) : jrw_tryrd(&e->n->lock)) {
+					node * n = e->n;
+					if (!node_attached(n)) {
+						jrw_unlock(&n->lock);
+						break;
+					}
+					jrw_unlock(&pcachelock);
+					pcache_count(1);
+					return n;
+				}
+				break;
+			}
+		}
+	}
+	jrw_unlock(&pcachelock);
+	pcache_count(0);
+	return NULL;
+}
+
+static void pcache_drop(struct pcent * e) {
+	struct pcent ** pp = &pcache[e->hash & (pcachecap - 1)];
+	while (*pp != e)
+		pp = &(*pp)->next;
+	jsetrel(*pp, e->next);
+	e->n->pcent = NULL;
+	pcachenum--;
+	epoch_retire(e, free);
+}
+
+/**writes the canonical spelling of path into d, which has room for it*/
+static void path_canon(char * d, const char * path) {
+	while (*path) {
+		if (*path == '/') {
+			while (*path == '/') path++;
+			if (!*path) break;
+			*d++ = '/';
+			continue;
+		}
+		*d++ = *path++;
+	}
+	*d = '\0';
+}
+
+static void pcache_insert(const char * path, node * n) {
+	struct pcent * e;
+	unsigned int h, b;
+	size_t len;
+	if (n == root)
+		return;
+	jrw_wr(&pcachelock);
+	/*--a lock free reader may hand in a node deleted since it found it--*/
+	if (n->pcent != NULL || jget(n->dead)) {
+		jrw_unlock(&pcachelock);
+		return;
+	}
+	if (pcachenum >= pcachecap && pcachecap < JFS_PATH_CACHE_MAX) {
+		/*--grow and rehash--*/
+		unsigned int i, newcap = pcachecap ? pcachecap * 2 : 1024;
+		struct pcent ** newtab = (struct pcent **) calloc(newcap, sizeof(struct pcent *));
+		struct pcent ** oldtab = pcache;
+		if (newtab != NULL) {
+			for (i = 0; i < pcachecap; i++) {
+				while (pcache[i] != NULL) {
+					e = pcache[i];
+					jsetrel(pcache[i], e->next);
+					jsetrel(e->next, newtab[e->hash & (newcap - 1)]);
+					newtab[e->hash & (newcap - 1)] = e;
+				}
+			}
+			jsetrel(pcache, newtab);
+			jsetrel(pcachecap, newcap);
+			if (oldtab != NULL)
+				epoch_retire(oldtab, free);
+		}
+	}
+	if (pcache == NULL) {
+		jrw_unlock(&pcachelock);
+		return;
+	}
+	h = pcache_hash(path, &len);
+	b = h & (pcachecap - 1);
+	if (pcachenum >= JFS_PATH_CACHE_MAX) {
+		/*--full: evict whatever shares our bucket, or give up--*/
+		if (pcache[b] == NULL) {
+			jrw_unlock(&pcachelock);
+			return;
+		}
+		pcache_drop(pcache[b]);
+	}
+	e = (struct pcent *) malloc(sizeof(struct pcent) + len);
+	if (e == NULL) {
+		jrw_unlock(&pcachelock);
+		return;
+	}
+	path_canon(e->path, path);
+	e->hash = h;
+	e->n = n;
+	e->next = pcache[b];
+	jsetrel(pcache[b], e);
+	n->pcent = e;
+	pcachenum++;
+	jrw_unlock(&pcachelock);
+}
+
+static void pcache_forget(node * n) {
+	jrw_wr(&pcachelock);
+	if (n->pcent != NULL)
+		pcache_drop(n->pcent);
+	jrw_unlock(&pcachelock);
+}
+
+void jfs_path_cache_stats(unsigned long * hits, unsigned long * misses) {
+	unsigned long h = 0, m = 0;
+#ifdef JAMRAMFS_THREADS
+	struct jthread * t;
+	jmx_lock(&jthreadslock);
+	for (t = jthreads; t != NULL; t = t->next) {
+		h += jget(t->hits);
+		m += jget(t->misses);
+	}
+	jmx_unlock(&jthreadslock);
+#else
+	h = jthreadonly.hits;
+	m = jthreadonly.misses;
+#endif
+	if (hits) *hits = h;
+	if (misses) *misses = m;
+}
+
+//####################################################################################
+
+/**
+ basename index: every distinct name once, with the list of resources
+ that carry it, so a find by name is one probe and a glob only has to
+ look at each distinct name once. Paths are rebuilt through father.
+ namelock covers the table and every node's name links; like
+ pcachelock it is only taken after node locks, never before one.
+ node_detach() takes a resource out of the index, under namelock,
+ before it is handed to reclamation, which frees nodes only through
+ the epoch; so nothing the index reaches is freed while namelock is
+ held. A subtree deleted whole is detached at its top first: its
+ father goes NULL, its sons stay indexed until subtree_free() detaches
+ them, and the top is freed after them. Walking father up from an
+ indexed resource thus ends at the root or at such a top, which is
+ not below any T, and name_report() skips it.
+*/
+struct nament {
+	struct nament * next;
+	node * nodes;
+	unsigned int hash;
+	char name[1];
+};
+static struct nament ** names;
+static unsigned int namescap;
+static unsigned int namesnum;
+static jrwlock namelock = JRWLOCK_INIT;
+
+static struct nament * name_get(const char * name, unsigned int h) {
+	struct nament * e;
+	if (names == NULL)
+		return NULL;
+	for (e = names[h & (namescap - 1)]; e != NULL; e = e->next)
+		if (e->hash == h && strcmp(e->name, name) == 0)
+			return e;
+	return NULL;
+}
+
+/**@return 0 okay, -1 out of memory*/
+static int name_add(node * n) {
+	struct nament * e;
+	size_t l;
+	jrw_wr(&namelock);
+	e = name_get(n->name, n->hash);
+	if (e == NULL) {
+		if (namesnum >= namescap) {
+			/*--grow and rehash, keep it at one name per bucket--*/
+			unsigned int i, newcap = namescap ? namescap * 2 : 1024;
+			struct nament ** newtab = (struct nament **) calloc(newcap, sizeof(struct nament *));
+			if (newtab == NULL && names == NULL) {
+				jrw_unlock(&namelock);
+				return -1;
+			}
+			if (newtab != NULL) {
+				for (i = 0; i < namescap; i++) {
+					while (names[i] != NULL) {
+						e = names[i];
+						names[i] = e->next;
+						e->next = newtab[e->hash & (newcap - 1)];
+						newtab[e->hash & (newcap - 1)] = e;
+					}
+				}
+				free(names);
+				names = newtab;
+				namescap = newcap;
+			}
+		}
+		l = strlen(n->name);
+		e = (struct nament *) arena_alloc(sizeof(struct nament) + l);
+		if (e == NULL) {
+			jrw_unlock(&namelock);
+			return -1;
+		}
+		memcpy(e->name, n->name, l + 1);
+		e->hash = n->hash;
+		e->nodes = NULL;
+		e->next = names[e->hash & (namescap - 1)];
+		names[e->hash & (namescap - 1)] = e;
+		namesnum++;
+	}
+	n->nameprev = NULL;
+	n->namenext = e->nodes;
+	if (e->nodes != NULL)
+		e->nodes->nameprev = n;
+	e->nodes = n;
+	n->nament = e;
+	jrw_unlock(&namelock);
+	return 0;
+}
+
+static void name_forget(node * n) {
+	struct nament * e;
+	jrw_wr(&namelock);
+	e = n->nament;
+	if (e == NULL) {
+		jrw_unlock(&namelock);
+		return;
+	}
+	if (n->nameprev != NULL)
+		n->nameprev->namenext = n->namenext;
+	else
+		e->nodes = n->namenext;
+	if (n->namenext != NULL)
+		n->namenext->nameprev = n->nameprev;
+	n->nament = NULL;
+	n->namenext = NULL;
+	n->nameprev = NULL;
+	if (e->nodes == NULL) {
+		struct nament ** pp = &names[e->hash & (namescap - 1)];
+		while (*pp != e)
+			pp = &(*pp)->next;
+		*pp = e->next;
+		namesnum--;
+		arena_free(e, sizeof(struct nament) + strlen(e->name));
+	}
+	jrw_unlock(&namelock);
+}
+
+/**
+ shell style match of a whole name: '*' any run of characters,
+ '?' any one character, anything else itself
+*/
+static int glob_match(const char * pat, const char * s) {
+	const char * star = NULL;
+	const char * retry = NULL;
+	while (*s) {
+		if (*pat == '*') {
+			star = ++pat;
+			retry = s;
+		}
+		else if (*pat == '?' || *pat == *s) {
+			pat++;
+			s++;
+		}
+		else if (star != NULL) {
+			pat = star;
+			s = ++retry;
+		}
+		else
+			return 0;
+	}
+	while (*pat == '*')
+		pat++;
+	return *pat == '\0';
+}
+
+static int name_match(const char * name, const char * pat, int glob) {
+	return glob ? glob_match(pat, name) : strcmp(name, pat) == 0;
+}
+
+/**
+ hands cb the path of every resource of entry e at or below T, built
+ backwards through father onto tpath in *buf; namelock is held
+ @param stop
+ set when cb asks to stop
+ @return matches reported, -1 when out of memory
+*/
+static long name_report(struct nament * e, node * T, const char * tpath, size_t tlen, int prune,
+                        char ** buf, size_t * bufcap, int * stop, jfs_find_cb cb, void * arg) {
+	node * n;
+	node * a;
+	long found = 0;
+	for (n = e->nodes; n != NULL; n = n->namenext) {
+		size_t len = tlen, l;
+		char * d;
+		for (a = n; a != NULL && a != T; a = jgetacq(a->father)) {
+			if (prune && a != n && strcmp(a->name, e->name) == 0)
+				break;		// inside another match
+			len += strlen(a->name) + 1;
+		}
+		if (a != T)
+			continue;		// not below T, or pruned
+		if (len + 1 > *bufcap) {
+			char * p = (char *) realloc(*buf, len + 1 + NAME_L);
+			if (p == NULL)
+				return -1;
+			*buf = p;
+			*bufcap = len + 1 + NAME_L;
+		}
+		d = *buf + len;
+		*d = '\0';
+		for (a = n; a != T; a = a->father) {
+			l = strlen(a->name);
+			d -= l;
+			memcpy(d, a->name, l);
+			*--d = '/';
+		}
+		memcpy(*buf, tpath, tlen);
+		found++;
+		if (cb(*buf, arg) != 0) {
+			*stop = 1;
+			break;
+		}
+	}
+	return found;
+}
+
+/**
+ find through the index, as find_walk() but T is not locked here,
+ the caller keeps it from going away
+ @param glob
+ name is a pattern, checked against every distinct name
+ @param prune
+ do not report matches inside another match
+*/
+static long name_lookup(node * T, const char * tpath, const char * name, int glob, int prune, jfs_find_cb cb, void * arg) {
+	struct nament * e;
+	char * buf;
+	size_t bufcap, tlen = strlen(tpath);
+	long r, found = 0;
+	unsigned int i;
+	int stop = 0;
+
+	if (prune && name_match(T->name, name, glob)) {
+		cb(tpath, arg);
+		return 1;
+	}
+	bufcap = tlen + NAME_L + 1;
+	buf = (char *) malloc(bufcap);
+	if (buf == NULL)
+		return -1;
+	jrw_rd(&namelock);
+	if (!glob) {
+		e = name_get(name, kid_hash(name, strlen(name)));
+		if (e != NULL)
+			found = name_report(e, T, tpath, tlen, prune, &buf, &bufcap, &stop, cb, arg);
+	}
+	else {
+		for (i = 0; i < namescap && !stop && found >= 0; i++) {
+			for (e = names[i]; e != NULL && !stop; e = e->next) {
+				if (!glob_match(name, e->name))
+					continue;
+				r = name_report(e, T, tpath, tlen, prune, &buf, &bufcap, &stop, cb, arg);
+				if (r < 0) {
+					found = -1;
+					break;
+				}
+				found += r;
+			}
+		}
+	}
+	jrw_unlock(&namelock);
+	free(buf);
+	return found;
+}
+
+//####################################################################################
+
+/**the tree has no explicit init, the root is made on first use*/
+static void root_make(void) {
+	root = create_element(NULL, NULL, "", DIR_T);
+}
+
+static int root_ready(void) {
+#ifdef JAMRAMFS_THREADS
+	static pthread_once_t once = PTHREAD_ONCE_INIT;
+	pthread_once(&once, root_make);
+#else
+	if (root == NULL)
+		root_make();
+#endif
+	return root != NULL;
+}
+
+//####################################################################################
+
+/**
+ reentrant stand in for strtok(path, "/")
+ @return the next component at or after p, with its length in len, NULL at the end
+*/
+static const char * path_next(const char * p, size_t * len) {
+	while (*p == '/')
+		p++;
+	if (*p == '\0')
+		return NULL;
+	*len = strcspn(p, "/");
+	return p;
+}
+
+/**
+ splits path for the calls that act on its last component
+ @return the number of components, the last one in last and lastlen
+*/
+static int path_last(const char * path, const char ** last, size_t * lastlen) {
+	const char * comp = path;
+	size_t len;
+	int n = 0;
+	*last = NULL;
+	*lastlen = 0;
+	while ((comp = path_next(comp, &len)) != NULL) {
+		*last = comp;
+		*lastlen = len;
+		comp += len;
+		n++;
+	}
+	return n;
+}
+
+//####################################################################################
+
+static void node_unlock(node * t) {
+	jrw_unlock(&t->lock);
+}
+
+/**takes K out of the sons of F, the caller holds both locked exclusive*/
+static void unlink_son(node * F, node * K) {
+	seq_write_begin(F);
+	if (K->prev != NULL)
+		K->prev->bro = K->bro;
+	else
+		F->son = K->bro;          // il nodo da eliminare e' in testa
+	if (K->bro != NULL)
+		K->bro->prev = K->prev;
+	else
+		F->lastson = K->prev;     // il nodo da eliminare e' in coda
+	kid_remove(F, K);
+	F->sonsnum--;
+	seq_write_end(F);
+	jset(K->father, NULL);
+	K->prev = NULL;
+	K->bro = NULL;
+}
+
+/**
+ hangs n, just made with F as father, after F's last son and in the
+ name index; F is held exclusive
+ @return 0 okay, -1 out of memory, n is then not linked
+*/
+static int son_link(node * F, node * n) {
+	seq_write_begin(F);
+	if (kid_insert(F, n) != 0) {
+		seq_write_end(F);
+		return -1;
+	}
+	/*--append to the sibling list so iteration keeps creation order--*/
+	n->prev = F->lastson;
+	if (F->lastson != NULL)
+		F->lastson->bro = n;
+	else
+		F->son = n;
+	F->lastson = n;
+	F->sonsnum++;
+	seq_write_end(F);
+	if (name_add(n) != 0) {
+		unlink_son(F, n);
+		return -1;
+	}
+	return 0;
+}
+
+//####################################################################################
+
+/*--
+ images: jfs_save() writes the tree out with offsets in place of
+ pointers, so jfs_load() reads the file in one go and builds
+ everything from it without any parsing, and jfs_mount() serves
+ lookups straight from it. The layout is header, file contents padded
+ to 8 bytes, node table, string table. The nodes come breadth first,
+ so each directory's sons sit together, sorted by name for a binary
+ search.
+--*/
+#define JIMG_MAGIC   "JRFS"
+#define JIMG_VERSION 3
+#define JIMG_ORDER   0x01020304u	// read back differently on a machine of the other byte order
+
+struct jimghead {
+	char magic[4];
+	uint32_t version;
+	uint32_t order;
+	uint32_t tag;		// the journal generation it folds in, 0 for jfs_save()
+	uint64_t nnodes;
+	uint64_t nodeoff;	// offsets from the start of the file
+	uint64_t stroff;
+	uint64_t strsz;
+	uint64_t dataoff;
+	uint64_t datasz;
+};
+
+struct jimgnode {
+	uint64_t data;		// from dataoff
+	uint64_t size;
+	uint32_t name;		// from stroff
+	uint32_t father;	// index of a node before this one, the root is 0 and its own father
+	uint32_t kids;		// index of the first son
+	uint32_t nkids;
+	uint32_t type;
+	uint32_t pad;
+};
+
+/**@return the string at off, NULL unless it lies whole inside the table*/
+static const char * img_string(const struct jimghead * h, const char * img, uint64_t off) {
+	if (off >= h->strsz)
+		return NULL;
+	return img + h->stroff + off;	// the table ends in a terminator, checked once
+}
+
+/**@return 0 okay, -1 when the header does not describe a sane image of sz bytes*/
+static int img_check(const struct jimghead * h, const char * img, size_t sz) {
+	if (memcmp(h->magic, JIMG_MAGIC, 4) != 0 || h->version != JIMG_VERSION || h->order != JIMG_ORDER)
+		return -1;
+	if (h->nnodes == 0 || h->nnodes > 0xffffffffu
+	|| h->dataoff != sizeof(*h) || h->datasz > sz - h->dataoff
+	|| h->nodeoff != ((h->dataoff + h->datasz + 7) & ~(uint64_t) 7) || h->nodeoff > sz
+	|| h->nnodes > (sz - h->nodeoff) / sizeof(struct jimgnode)
+	|| h->stroff != h->nodeoff + h->nnodes * sizeof(struct jimgnode)
+	|| h->strsz != sz - h->stroff
+	|| h->strsz == 0 || img[sz - 1] != '\0')
+		return -1;
+	return 0;
+}
+
+/*--
+ the mounted image is the lower layer under the tree: what the tree
+ lacks is looked up in the image, and brought over (copied up) the
+ first time it is locked, files sharing the image's bytes until their
+ first write. Deleting something that came from the image hides its
+ record, and with it everything below. Only the header was checked at
+ mount time, so each record is bounds checked as it is read.
+--*/
+static const char * imgbase;		// the mounted image, NULL if none
+static struct jimghead imghead;
+static unsigned char * imghidden;	// per record, set once deleted
+
+static const struct jimgnode * img_rec(uint64_t i) {
+	return (const struct jimgnode *)(imgbase + imghead.nodeoff) + i;
+}
+
+/**
+ binary search of record i's sons
+ @return 1 + the son named name[0..len), 0 if none or hidden
+*/
+static uint32_t img_child(uint64_t i, const char * name, size_t len) {
+	const struct jimgnode * r = img_rec(i);
+	uint64_t lo = r->kids, hi = (uint64_t) r->kids + r->nkids;
+	if (r->type != DIR_T || r->nkids == 0 || lo <= i || hi > imghead.nnodes)
+		return 0;
+	while (lo < hi) {
+		uint64_t mid = lo + (hi - lo) / 2;
+		const char * s = img_string(&imghead, imgbase, img_rec(mid)->name);
+		int c;
+		if (s == NULL)
+			return 0;
+		c = jamcmp(s, name, len, '\0');
+		if (c == 0)
+			return jget(imghidden[mid]) ? 0 : (uint32_t)(mid + 1);
+		if (c < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return 0;
+}
+
+/**@return 1 + the record of F's son named name[0..len) in the image, 0 if none*/
+static uint32_t img_kid_find(node * F, const char * name, size_t len) {
+	if (F->img == 0 || jget(imghidden[F->img - 1]))
+		return 0;
+	return img_child(F->img - 1, name, len);
+}
+
+/**K is being deleted: its record, and all below, are not to be found again*/
+static void img_hide(node * K) {
+	if (K->img != 0)
+		jset(imghidden[K->img - 1], 1);
+}
+
+/**
+ copies up F's son named name[0..len) from the image, F held exclusive
+ @return the new node, not locked, or NULL
+*/
+static node * img_kid_make(node * F, const char * name, size_t len) {
+	uint32_t k = img_kid_find(F, name, len);
+	const struct jimgnode * r;
+	node * n;
+	if (k == 0)
+		return NULL;
+	r = img_rec(k - 1);
+	if ((r->type != DIR_T && r->type != FILE_T)
+	|| (r->type == FILE_T && (r->data > imghead.datasz || r->size > imghead.datasz - r->data)))
+		return NULL;
+	n = create_element(NULL, F, (char *) img_string(&imghead, imgbase, r->name), (char) r->type);
+	if (n == NULL)
+		return NULL;
+	n->img = k;
+	if (r->type == FILE_T && r->size != 0) {
+		/*--no capacity: data_reserve() moves it to a buffer of its own on the
+		    first write, or past JFS_EXTENT bytes into extents, never one buffer--*/
+		n->data = (char *) imgbase + imghead.dataoff + r->data;
+		n->datasz = (size_t) r->size;
+	}
+	if (son_link(F, n) != 0) {
+		destroy_element(n);
+		return NULL;
+	}
+	return n;
+}
+
+/**
+ copies up every son of K the tree does not have yet, K held exclusive
+ @return 0 okay, -1 out of memory
+*/
+static int img_kids_make(node * K) {
+	const struct jimgnode * r;
+	uint64_t i;
+	if (K->img == 0 || jget(imghidden[K->img - 1]))
+		return 0;
+	r = img_rec(K->img - 1);
+	if (r->type != DIR_T || r->nkids == 0 || r->kids < K->img || (uint64_t) r->kids + r->nkids > imghead.nnodes)
+		return 0;
+	for (i = r->kids; i < (uint64_t) r->kids + r->nkids; i++) {
+		const char * s = img_string(&imghead, imgbase, img_rec(i)->name);
+		size_t l;
+		if (s == NULL || jget(imghidden[i]))
+			continue;
+		l = strlen(s);
+		if (kid_find(K, s, l) == NULL && img_kid_make(K, s, l) == NULL)
+			return -1;
+	}
+	return 0;
+}
+
+/**@return non zero if K, held, has sons in the image that are not hidden*/
+static int img_kids_left(node * K) {
+	const struct jimgnode * r;
+	uint64_t i;
+	if (K->img == 0 || jget(imghidden[K->img - 1]))
+		return 0;
+	r = img_rec(K->img - 1);
+	if (r->type != DIR_T || r->nkids == 0 || r->kids < K->img || (uint64_t) r->kids + r->nkids > imghead.nnodes)
+		return 0;
+	for (i = r->kids; i < (uint64_t) r->kids + r->nkids; i++)
+		if (!jget(imghidden[i]))
+			return 1;
+	return 0;
+}
+
+/**
+ read_file() straight from the mounted image, nothing copied up, for
+ a path the tree does not have
+ @return as file_get()
+*/
+static long img_get(const char * path, const char * name, void * buf, size_t bufsz) {
+	const struct jimgnode * r;
+	const char * comp;
+	const char * s;
+	size_t len;
+	uint32_t k = 1;
+	if (jgetacq(imgbase) == NULL || jget(imghidden[0]))
+		return -1;
+	for (comp = path_next(path, &len); comp != NULL && k != 0; comp = path_next(comp + len, &len))
+		k = img_child(k - 1, comp, len);
+	if (k == 0)
+		return -1;
+	r = img_rec(k - 1);
+	s = img_string(&imghead, imgbase, r->name);
+	if (r->type != FILE_T || s == NULL || strcmp(s, name) != 0
+	|| r->data > imghead.datasz || r->size > imghead.datasz - r->data)
+		return -1;
+	if (r->size)
+		memcpy(buf, imgbase + imghead.dataoff + r->data, r->size < bufsz ? (size_t) r->size : bufsz);
+	return (long) r->size;
+}
+
+//####################################################################################
+
+/**
+ walk_locked() on the tree alone
+ @param img
+ set when the walk stopped at a node that has a record in the image
+*/
+static node * walk_once(const char * path, int ncomp, int excl, int * img) {
+	node * t;
+	node * c;
+	const char * comp;
+	const char * next;
+	size_t len, nlen = 0;
+	unsigned int depth = 0, probes;
+
+	if (!root_ready())
+		return NULL;
+	t = root;
+	comp = path_next(path, &len);
+	if (comp == NULL || ncomp == 0) {
+		if (excl) jrw_wr(&t->lock); else jrw_rd(&t->lock);
+		stat_walk(0);
+		return t;
+	}
+	jrw_rd(&t->lock);
+	while (comp != NULL && ncomp != 0) {  // questo ciclo sposta t lungo il percorso
+		next = path_next(comp + len, &nlen);
+		probes = 0;
+		c = kid_probe(t, comp, len, &probes);
+		stat_scan(probes);
+		depth++;
+		if (c == NULL) {  // non ho trovato la risorsa cercata
+			if (t->img != 0)
+				*img = 1;
+			node_unlock(t);
+			stat_walk(depth);
+			return NULL;
+		}
+		if (excl && (next == NULL || ncomp == 1))
+			jrw_wr(&c->lock);
+		else
+			jrw_rd(&c->lock);
+		node_unlock(t);
+		t = c;
+		comp = next;
+		len = nlen;
+		if (ncomp > 0)
+			ncomp--;
+	}
+	stat_walk(depth);
+	return t;
+}
+
+/**
+ brings the first ncomp components of path (all of them if ncomp < 0)
+ over from the mounted image where the tree lacks them, with exclusive
+ lock coupling
+ @return 0 okay, -1 if one is in neither
+*/
+static int img_copyup(const char * path, int ncomp) {
+	node * t = root;
+	node * c;
+	const char * comp;
+	size_t len;
+	if (in_find())		// the root may be held shared by the find
+		return -1;
+	jrw_wr(&t->lock);
+	for (comp = path_next(path, &len); comp != NULL && ncomp != 0; comp = path_next(comp + len, &len)) {
+		c = kid_find(t, comp, len);
+		if (c == NULL)
+			c = img_kid_make(t, comp, len);
+		if (c == NULL) {
+			node_unlock(t);
+			return -1;
+		}
+		jrw_wr(&c->lock);
+		node_unlock(t);
+		t = c;
+		if (ncomp > 0)
+			ncomp--;
+	}
+	node_unlock(t);
+	return 0;
+}
+
+/**
+ walks the first ncomp components of path (all of them if ncomp < 0)
+ with lock coupling: a child is locked before its parent is let go.
+ @param excl
+ lock the node reached exclusive rather than shared
+ @return the node reached, locked, or NULL with nothing held
+*/
+static node * walk_locked(const char * path, int ncomp, int excl) {
+	int img = 0;
+	node * t = walk_once(path, ncomp, excl, &img);
+	/*--stopped where the mounted image goes on: copy up and walk again--*/
+	if (t == NULL && img && img_copyup(path, ncomp) == 0)
+		t = walk_once(path, ncomp, excl, &img);
+	return t;
+}
+
+/**
+ the son of F, which the caller holds exclusive, named name[0..len),
+ copied up first if only the mounted image has it
+ @return NULL if there is none
+*/
+static node * path_kid(node * F, const char * name, size_t len) {
+	node * t = kid_find(F, name, len);
+	return t != NULL ? t : img_kid_make(F, name, len);
+}
+
+/**full path lookup, through the cache, the node comes back locked*/
+static node * path_lock(const char * path, int excl) {
+	node * t;
+	t = pcache_lookup(path, excl);
+	if (t != NULL)
+		return t;
+	t = walk_locked(path, -1, excl);
+	if (t != NULL)
+		pcache_insert(path, t);
+	return t;
+}
+
+/**
+ lock free full path lookup, cache first, for readers inside an epoch:
+ no lock is taken and nothing shared is written, but on a cache miss.
+ @return the node, which may be deleted the moment after but stays
+ readable until the epoch is left, or NULL
+*/
+static node * path_find(const char * path) {
+	node * t;
+	node * c;
+	const char * comp;
+	size_t len;
+	unsigned int s, depth = 0, probes;
+
+	t = pcache_find(path);
+	if (t != NULL)
+		return t;
+	if (!root_ready())
+		return NULL;
+	t = root;
+	for (comp = path_next(path, &len); comp != NULL; comp = path_next(comp + len, &len)) {
+		do {
+			s = seq_read_begin(t);
+			probes = 0;
+			c = kid_probe(t, comp, len, &probes);
+		} while (seq_read_retry(t, s));
+		stat_scan(probes);
+		depth++;
+		if (c == NULL) {
+			stat_walk(depth);
+			return NULL;
+		}
+		t = c;
+	}
+	stat_walk(depth);
+	pcache_insert(path, t);
+	return t;
+}
+
+/**
+ the node is handed back unprotected, so with threads this is only
+ safe while nothing can delete it
+*/
+node * path_travel(char * path) {
+	node * t = NULL;
+	struct jthread * me = epoch_enter();
+	if (me != NULL) {
+		t = path_find(path);
+		epoch_leave(me);
+	}
+	if (t == NULL && (me == NULL || jgetacq(imgbase) != NULL)) {
+		/*--the locked walk also copies up from a mounted image--*/
+		t = path_lock(path, 0);
+		if (t != NULL)
+			node_unlock(t);
+	}
+	return t;
+}
+
+//####################################################################################
+
+#ifdef JAMRAMFS_JOURNAL
+/**
+ records op on K's full path, for a caller that only has K: its
+ father is held, those further up are read inside an epoch, and a
+ delete_r() that cuts them off meanwhile has logged itself
+ @return -1 out of memory
+*/
+static int journal_node(int op, node * K) {
+	struct jthread * me;
+	node * t;
+	size_t l = 0;
+	char * path = NULL;
+	char * p;
+	if (!jget(jnon))
+		return 0;
+	me = epoch_enter();
+	if (me == NULL)
+		return -1;
+	for (t = K; t != root && t != NULL; t = jget(t->father))
+		l += strlen(t->name) + 1;
+	if (t != NULL)
+		path = (char *) malloc(l + 1);
+	if (path != NULL) {
+		p = path + l;
+		*p = '\0';
+		for (t = K; t != root && t != NULL; t = jget(t->father)) {
+			size_t n = strlen(t->name);
+			p -= n;
+			memcpy(p, t->name, n);
+			*--p = '/';
+		}
+		if (t != NULL)
+			journal_add(op, p, NULL, NULL, 0, 0);
+		free(path);
+	}
+	epoch_leave(me);
+	return t != NULL && path == NULL ? -1 : 0;
+}
+
+#else
+#define journal_node(op, K) 0
+#endif
+
+//####################################################################################
+
+static enum returnCode create_do(char * name, char * path, int path_length, char res_type, uint64_t * lsn) {
+
+	node * new;
+	node * f;
+	const char * last;
+	size_t lastlen;
+
+	if (path_length < 1 || name[0] == '\0' || strlen(name) >= NAME_L
+	|| strchr(name, '/') != NULL)		// as jfs_load() would refuse it
+		return NO;
+	f = walk_locked(path, path_length - 1, 1);  // il padre, bloccato in scrittura
+	if (f == NULL) {  // percorso non valido, sto cercando di creare un nodo sotto ad un altro non esistente
+		return NO;
+	}
+
+	if (f->type == FILE_T || f->sonsnum == MAX_SONS || kid_find(f, name, strlen(name)) != NULL
+	|| img_kid_find(f, name, strlen(name)) != 0) {		// already in the mounted image
+		node_unlock(f);
+		return NO;
+	}
+
+	new = create_element(NULL, f, name, res_type);
+	if (new == NULL) {
+		node_unlock(f);
+		return NO;
+	}
+	if (son_link(f, new) != 0) {
+		destroy_element(new);
+		node_unlock(f);
+		return NO;
+	}
+	if (path_last(path, &last, &lastlen) == path_length && lastlen == strlen(name)
+	&& memcmp(last, name, lastlen) == 0)		// path is only cached if it names new
+		pcache_insert(path, new);
+	*lsn = journal_add(JOP_CREATE, path, name, &res_type, 1, path_length);
+	node_unlock(f);
+	return OK;
+}
+
+enum returnCode create(char * name, char * path, int path_length, char res_type) {
+	uint64_t t0 = stat_begin();
+	uint64_t lsn = 0;
+	int held = journal_enter(0);
+	enum returnCode r = held < 0 ? NO : create_do(name, path, path_length, res_type, &lsn);
+	if (journal_leave(held, lsn) != 0)
+		r = NO;
+	stat_end(JST_CREATE, t0);
+	return r;
+}
+
+//####################################################################################
+
+/**
+ copies t's content out with no lock, going again if a writer got in
+ the way; the buffer is only ever retired, so it stays readable
+ @return the full size
+*/
+static size_t data_snapshot(node * t, void * buf, size_t bufsz) {
+	unsigned int s;
+	const char * d;
+	struct jexttab * tab;
+	size_t sz;
+	for (;;) {
+		s = seq_read_begin(t);
+		d = jget(t->data);
+		tab = jgetacq(t->ext);
+		sz = jget(t->datasz);
+		if (seq_read_retry(t, s))
+			continue;			// d, tab and sz might not belong together
+		data_copy(d, tab, 0, buf, sz < bufsz ? sz : bufsz);
+		if (!seq_read_retry(t, s))
+			return sz;
+	}
+}
+
+/**
+ what read_file() and read_file_n() share: lock free inside an epoch,
+ or through the node lock if this thread has no epoch record
+ @return the full size, -1 when path is not the file name
+*/
+static long file_get(const char * path, const char * name, void * buf, size_t bufsz) {
+	struct jthread * me = epoch_enter();
+	node * t;
+	long r = -1;
+
+	if (me != NULL) {
+		t = path_find(path);
+		if (t == NULL)
+			r = img_get(path, name, buf, bufsz);
+		else if (t->type == FILE_T && strcmp(t->name, name) == 0)
+			r = (long) data_snapshot(t, buf, bufsz);
+		epoch_leave(me);
+		return r;
+	}
+	t = path_lock(path, 0);
+	if (t == NULL)
+		return -1;
+	if (strcmp(t->name, name) == 0 && t->type == FILE_T) {
+		data_get(t, 0, buf, t->datasz < bufsz ? t->datasz : bufsz);
+		r = (long) t->datasz;
+	}
+	node_unlock(t);
+	return r;
+}
+
+//####################################################################################
+
+long read_file_n(char * path, char * name, void * contenuto, size_t bufsz) {
+	uint64_t t0 = stat_begin();
+	long r = file_get(path, name, contenuto, bufsz);
+	stat_end(JST_READ, t0);
+	return r;
+}
+
+//####################################################################################
+
+enum returnCode read_file(char * path, char * name, char * contenuto) {
+
+	uint64_t t0 = stat_begin();
+	long r = file_get(path, name, contenuto, (size_t)-1);
+
+	stat_end(JST_READ, t0);
+	if (r < 0) {
+		return NO;
+	}
+	contenuto[r] = '\0';
+	return OK;
+
+}
+
+//####################################################################################
+
+static long write_do(char * path, char * name, const void * contenuto, size_t len, uint64_t * lsn) {
+
+	node * t;
+	long r = -1;
+
+	t = path_lock(path, 1);
+
+	if (t == NULL) {
+		return -1;
+	}
+
+	if (strcmp(t->name, name) == 0 && t->type == FILE_T) {
+		seq_write_begin(t);
+		if (data_reserve(t, len) == 0 && data_put(t, 0, contenuto, len) == 0
+		&& data_trunc(t, len) == 0)
+			r = (long) len;
+		seq_write_end(t);
+		if (r >= 0)
+			*lsn = journal_add(JOP_WRITE, path, name, contenuto, len, 0);
+	}
+
+	node_unlock(t);
+	return r;
+
+}
+
+long write_file_n(char * path, char * name, const void * contenuto, size_t len) {
+	uint64_t t0 = stat_begin();
+	uint64_t lsn = 0;
+	int held = journal_enter(0);
+	long r = held < 0 ? -1 : write_do(path, name, contenuto, len, &lsn);
+	if (journal_leave(held, lsn) != 0)
+		r = -1;
+	stat_end(JST_WRITE, t0);
+	return r;
+}
+
+//####################################################################################
+
+int write_file(char * path, char * name, const char * contenuto) {
+	return (int) write_file_n(path, name, contenuto, strlen(contenuto));
+}
+
+//####################################################################################
+
+/**what jfs_fallocate() and jfs_punch_hole() share*/
+static int range_do(const char * path, off_t offset, off_t len, int punch) {
+	node * t;
+	int r = -1;
+	if (path == NULL || offset < 0 || len < 0 || (!punch && len == 0))
+		return -1;
+	t = path_lock(path, 1);
+	if (t == NULL)
+		return -1;
+	if (t->type == FILE_T) {
+		seq_write_begin(t);
+		if (!punch)
+			r = data_alloc(t, (size_t) offset, (size_t) len);
+		else if ((size_t) offset >= t->datasz)
+			r = 0;
+		else	// no further than the end, the size stays
+			r = data_punch(t, (size_t) offset,
+			               (size_t) len < t->datasz - (size_t) offset ? (size_t) len : t->datasz - (size_t) offset);
+		seq_write_end(t);
+	}
+	node_unlock(t);
+	return r;
+}
+
+int jfs_fallocate(const char * path, off_t offset, off_t len) {
+	return range_do(path, offset, len, 0);
+}
+
+int jfs_punch_hole(const char * path, off_t offset, off_t len) {
+	return range_do(path, offset, len, 1);
+}
+
+//####################################################################################
+
+/**
+ takes K out of its father F and out of the cache and the index; both
+ are locked exclusive and stay so. Lookups stop finding K, and
+ everything below it, right away.
+*/
+static void node_detach(node * F, node * K) {
+	img_hide(K);		// before it leaves the tree, so lookups cannot fall through to it
+	jset(K->dead, 1);
+	name_forget(K);
+	unlink_son(F, K);
+	pcache_forget(K);
+}
+
+/**
+ lets go of a detached K, still locked, and frees it unless a stream,
+ a view or a parallel walk holds it: then the last of those frees it
+*/
+static void node_finish(node * K, struct nodebatch ** b) {
+	int idle = K->opens == 0 && K->maps == 0 && jgetacq(K->pins) == 0;
+	node_unlock(K);
+	if (idle)
+		batch_add(b, K);
+}
+
+/**
+ drops a pin taken on n, freeing it if that was the last hold on a
+ deleted resource
+*/
+static void node_unpin(node * n) {
+	int last;
+	jrw_rd(&n->lock);
+	last = jadd(n->pins, -1) == 0 && jget(n->dead) && n->opens == 0 && n->maps == 0;
+	node_unlock(n);
+	if (last)
+		destroy_element(n);
+}
+
+/**
+ locks K's father, then K, both exclusive. K must be kept from being
+ freed meanwhile (pinned).
+ @return the father, or NULL when K is no longer in the tree and only K is locked
+*/
+static node * father_lock(node * K) {
+	node * F;
+	for (;;) {
+		jrw_rd(&K->lock);
+		F = K->father;
+		if (F == NULL) {
+			node_unlock(K);
+			jrw_wr(&K->lock);
+			return NULL;
+		}
+		/*--while K is held F cannot go, but F comes first in the lock order--*/
+		if (jrw_trywr(&F->lock)) {
+			node_unlock(K);
+			jrw_wr(&K->lock);	// K cannot move, F is held
+			return F;
+		}
+		node_unlock(K);
+#ifdef JAMRAMFS_THREADS
+		sched_yield();
+#endif
+	}
+}
+
+/**
+ removes everything below R, which is locked exclusive and already
+ detached (or is the root), then R itself unless keep. Bottom up with
+ no stack: the way down is always the first son, the way back father.
+ The directories on the way down stay locked, so work already under
+ way inside the subtree finishes first and nothing new gets in.
+ R is unlocked on return.
+ @return the number of resources removed
+*/
+static long subtree_free(node * R, int keep) {
+	struct nodebatch * b = NULL;
+	node * d = R;
+	node * c;
+	long n = 0;
+
+	for (;;) {
+		c = d->son;
+		if (c != NULL) {
+			jrw_wr(&c->lock);
+			if (c->son != NULL) {
+				d = c;
+				continue;
+			}
+			node_detach(d, c);
+			node_finish(c, &b);
+			n++;
+			continue;
+		}
+		if (d == R)
+			break;
+		c = d;
+		d = c->father;		// locked on the way down
+		node_detach(d, c);
+		node_finish(c, &b);
+		n++;
+	}
+	if (keep)
+		node_unlock(R);
+	else {
+		node_finish(R, &b);
+		n++;
+	}
+	batch_flush(&b);
+	return n;
+}
+
+//####################################################################################
+
+static enum returnCode delete_do(char * path, char * name, uint64_t * lsn) {
+
+		node * t;
+		node * f;
+		const char * last;
+		size_t lastlen;
+		int n;
+
+		n = path_last(path, &last, &lastlen);
+		if (n == 0) {				// la radice non si elimina
+			return NO;
+		}
+
+		f = walk_locked(path, n - 1, 1);
+		if (f == NULL) {
+			return NO;
+		}
+		t = path_kid(f, last, lastlen);
+		if (t == NULL) {
+			node_unlock(f);
+			return NO;
+		}
+		jrw_wr(&t->lock);
+
+		if ((t->type == DIR_T && (t->sonsnum != 0 || img_kids_left(t)))
+		|| t->opens != 0 || t->maps != 0		// still bound to a JILE or mapped
+		|| jgetacq(t->pins) != 0				// queued by a parallel walk
+		|| strcmp(t->name, name) != 0) {
+			node_unlock(t);
+			node_unlock(f);
+			return NO;
+		}
+
+		node_detach(f, t);
+		*lsn = journal_add(JOP_DELETE, path, name, NULL, 0, 0);
+		node_unlock(t);
+		node_unlock(f);
+		destroy_element(t);
 		return OK;
+}
+
+enum returnCode delete(char * path, char * name) {
+	uint64_t t0 = stat_begin();
+	uint64_t lsn = 0;
+	int held = journal_enter(0);
+	enum returnCode r = held < 0 ? NO : delete_do(path, name, &lsn);
+	if (journal_leave(held, lsn) != 0)
+		r = NO;
+	stat_end(JST_DELETE, t0);
+	return r;
+}
+
+//####################################################################################
+
+/**
+ deletes R, its bro chain and everything below them, each subtree cut
+ off first and then torn down; files still open or mapped live on
+ until their last jclose() or junmap().
+ The caller holds R->father locked exclusive.
+ @return del_num plus the number of resources deleted
+*/
+int delete_r(node * R, int del_num) {
+
+	node * F = R->father;
+	node * next;
+
+	for (; R != NULL; R = next) {
+		next = R->bro;
+		jrw_wr(&R->lock);
+		node_detach(F, R);
+		del_num += (int) subtree_free(R, 0);
+	}
+	return del_num;
+
+}
+
+/**
+ takes K, locked exclusive like its father F, out of the tree unless
+ something still needs it; a pin held by the caller is allowed for
+ @return 1 if it went, 0 if it stays
+*/
+static int delete_if_idle(node * F, node * K, int pinned) {
+	if ((K->type == DIR_T && K->sonsnum != 0)
+	|| K->opens != 0 || K->maps != 0 || jgetacq(K->pins) != pinned
+	|| journal_node(JOP_DELETE_R, K) != 0) {
+		node_unlock(K);
+		return 0;
+	}
+	node_detach(F, K);
+	node_unlock(K);
+	destroy_element(K);
+	return 1;
+}
+
+/**
+ @return 1 if something below R, which is locked exclusive, is open or
+ mapped. The directories on the way down are read locked, as in
+ subtree_free(), and let go again on the way up.
+*/
+static int subtree_busy(node * R) {
+	node * d = R;
+	node * c = R->son;
+	node * nx;
+	for (;;) {
+		if (c != NULL) {
+			jrw_rd(&c->lock);
+			if (c->opens != 0 || c->maps != 0) {
+				node_unlock(c);
+				break;
+			}
+			if (c->son != NULL) {
+				d = c;
+				c = c->son;
+				continue;
+			}
+			nx = c->bro;
+			node_unlock(c);
+			c = nx;
+			continue;
+		}
+		if (d == R)
+			return 0;
+		c = d;
+		d = c->father;
+		nx = c->bro;
+		node_unlock(c);
+		c = nx;
+	}
+	for (; d != R; d = c) {
+		c = d->father;
+		node_unlock(d);
+	}
+	return 1;
+}
+
+/**
+ deletes what is below R and then R, as subtree_free() does, but keeps
+ whatever is open, mapped or pinned and the directories leading to it.
+ Each deletion is logged on its own, as jfs_delete_par() does. R is
+ locked exclusive, as is its father F, and R is unlocked on return.
+ @return the number of resources deleted
+*/
+static long subtree_prune(node * F, node * R) {
+	node * d = R;
+	node * c;
+	node * nx;
+	long n = 0;
+	img_kids_make(R);		// what is only in a mounted image goes too
+	c = R->son;
+	for (;;) {
+		if (c != NULL) {
+			nx = c->bro;
+			jrw_wr(&c->lock);
+			if (c->type == DIR_T) {
+				img_kids_make(c);
+				if (c->son != NULL) {
+					d = c;		// kept locked until it is done
+					c = c->son;
+					continue;
+				}
+			}
+			n += delete_if_idle(d, c, 0);
+			c = nx;
+			continue;
+		}
+		if (d == R)
+			break;
+		c = d;
+		d = c->father;
+		nx = c->bro;
+		n += delete_if_idle(d, c, 0);
+		c = nx;
+	}
+	return n + delete_if_idle(F, R, 0);
+}
+
+/**
+ @param op
+ JOP_DELETE_R, or JOP_REMOVE for jremove(), which leaves the root and
+ files still open or mapped alone, with the directories above them
+*/
+static long delete_r_do(const char * path, int op, uint64_t * lsn) {
+
+	node * t;
+	node * f;
+	const char * last;
+	size_t lastlen;
+	int n;
+
+	if (path == NULL)
+		return -1;
+	n = path_last(path, &last, &lastlen);
+	if (n == 0) {		// the root stays, only what is in it goes
+		if (op == JOP_REMOVE || !root_ready())
+			return -1;
+		jrw_wr(&root->lock);
+		img_hide(root);
+		*lsn = journal_add(op, path, NULL, NULL, 0, 0);
+		return subtree_free(root, 1);
+	}
+	f = walk_locked(path, n - 1, 1);
+	if (f == NULL)
+		return -1;
+	t = path_kid(f, last, lastlen);
+	if (t == NULL) {
+		node_unlock(f);
+		return -1;
+	}
+	jrw_wr(&t->lock);
+	if (op == JOP_REMOVE && t->type == FILE_T
+	&& (t->opens != 0 || t->maps != 0 || jgetacq(t->pins) != 0)) {
+		node_unlock(t);
+		node_unlock(f);
+		return -1;
+	}
+	if (op == JOP_REMOVE && t->type == DIR_T && subtree_busy(t)) {
+		long r = subtree_prune(f, t);
+		node_unlock(f);
+		*lsn = journal_tail();		// each deletion was logged on its own
+		return r;
+	}
+	node_detach(f, t);
+	*lsn = journal_add(op, path, NULL, NULL, 0, 0);
+	node_unlock(f);
+	return subtree_free(t, 0);
+
+}
+
+long jfs_delete_r(const char * path) {
+	uint64_t t0 = stat_begin();
+	uint64_t lsn = 0;
+	int held = journal_enter(0);
+	long r = held < 0 ? -1 : delete_r_do(path, JOP_DELETE_R, &lsn);
+	if (journal_leave(held, lsn) != 0)
+		r = -1;
+	stat_end(JST_DELETE_R, t0);
+	return r;
+}
+
+/*--
+ the fallback API, on the tree like everything else: jkdir() makes
+ the directories missing on the way down as well, as paths in the old
+ flat index needed no parents, and jremove() takes a directory with
+ everything in it, like jfs_delete_r()
+--*/
+static int kdir_do(const char* filename) {
+	const char* comp;
+	char* path;
+	size_t len, l;
+	int n = 0, r = -1;
+	if (!filename)
+		return -1;
+	l = strlen(filename);
+	path = (char*)malloc(l + 1);
+	if (!path)
+		return -1;
+	memcpy(path, filename, l + 1);
+	for (comp = filename; (comp = path_next(comp, &len)) != NULL; comp += len) {
+		char name[NAME_L];
+		char c = path[comp - filename + len];
+		if (len >= NAME_L) {
+			r = -1;
+			break;
+		}
+		memcpy(name, comp, len);
+		name[len] = '\0';
+		path[comp - filename + len] = '\0';		// just the way down to here
+		r = create(name, path, ++n, DIR_T) == OK ? 0 : -1;
+		path[comp - filename + len] = c;
+	}
+	free(path);
+	return r;		// what became of the last one
+}
+int jkdir(const char* filename, int mode) {
+	uint64_t t0 = stat_begin();
+	int r = kdir_do(filename);
+	(void)mode;
+	stat_end(JST_JKDIR, t0);
+	return r;
+}
+int jremove(const char* const path) {
+	uint64_t t0 = stat_begin();
+	uint64_t lsn = 0;
+	int held = journal_enter(0);
+	long r = held < 0 ? -1 : delete_r_do(path, JOP_REMOVE, &lsn);
+	if (journal_leave(held, lsn) != 0)
+		r = -1;
+	stat_end(JST_JREMOVE, t0);
+	return r < 0 ? -1 : 0;
+}
+
+//####################################################################################
+
+/*--
+ background reclaimer: jfs_delete_async() cuts a subtree off and hands
+ it over here, one thread tears the handed over subtrees down. The queue
+ is bounded; once it is full the caller frees the subtree itself, so a
+ burst of deletes is slowed down rather than piling up.
+--*/
+#ifndef JFS_REAP_QUEUE_MAX
+#define JFS_REAP_QUEUE_MAX 256
+#endif
+
+#ifdef JAMRAMFS_THREADS
+static node * reapq[JFS_REAP_QUEUE_MAX];
+static unsigned int reaphead;	// next to free
+static unsigned int reapnum;	// queued
+static int reapbusy;			// a subtree taken off the queue, still being freed
+static jmutex reaplock = JMUTEX_INIT;
+static pthread_cond_t reapwake = PTHREAD_COND_INITIALIZER;	// something queued
+static pthread_cond_t reapidle = PTHREAD_COND_INITIALIZER;	// the queue ran dry
+static int reapstate;			// 0 not started, 1 running, -1 could not start
+
+static void * reap_worker(void * arg) {
+	node * R;
+	(void) arg;
+	jmx_lock(&reaplock);
+	for (;;) {
+		while (reapnum == 0) {
+			reapbusy = 0;
+			pthread_cond_broadcast(&reapidle);
+			pthread_cond_wait(&reapwake, &reaplock);
+		}
+		R = reapq[reaphead];
+		reaphead = (reaphead + 1) % JFS_REAP_QUEUE_MAX;
+		reapnum--;
+		reapbusy = 1;
+		jmx_unlock(&reaplock);
+		jrw_wr(&R->lock);
+		subtree_free(R, 0);
+		jmx_lock(&reaplock);
+	}
+	return NULL;
+}
+#endif
+
+/**
+ queues R, already detached and not locked, for the reclaimer, or
+ frees it right here when the queue is full or there is no reclaimer
+*/
+static void reap_push(node * R) {
+#ifdef JAMRAMFS_THREADS
+	jmx_lock(&reaplock);
+	if (reapstate == 0) {
+		pthread_t th;
+		reapstate = -1;
+		if (pthread_create(&th, NULL, reap_worker, NULL) == 0) {
+			pthread_detach(th);
+			reapstate = 1;
+		}
+	}
+	if (reapstate == 1 && reapnum < JFS_REAP_QUEUE_MAX) {
+		reapq[(reaphead + reapnum) % JFS_REAP_QUEUE_MAX] = R;
+		reapnum++;
+		pthread_cond_signal(&reapwake);
+		jmx_unlock(&reaplock);
+		return;
+	}
+	jmx_unlock(&reaplock);
+#endif
+	jrw_wr(&R->lock);
+	subtree_free(R, 0);
+}
+
+static long delete_async_do(const char * path, uint64_t * lsn) {
+
+	node * t;
+	node * f;
+	node ** kids;
+	const char * last;
+	size_t lastlen;
+	int n;
+
+	if (path == NULL)
+		return -1;
+	n = path_last(path, &last, &lastlen);
+	if (n == 0) {		// the root stays, each of its sons goes
+		if (!root_ready())
+			return -1;
+		/*--the sons move, table and all, under one detached holder, so the reclaimer gets a single job--*/
+		f = create_element(NULL, NULL, "", DIR_T);
+		if (f == NULL)
+			return -1;
+		jrw_wr(&root->lock);
+		kids = (node **) calloc(root->kidscap != 0 ? root->kidscap : 1, sizeof(node *));
+		if (kids == NULL) {
+			node_unlock(root);
+			destroy_element(f);
+			return -1;
+		}
+		img_hide(root);
+		*lsn = journal_add(JOP_DELETE_R, path, NULL, NULL, 0, 0);
+		seq_write_begin(root);
+		f->son = root->son;
+		f->lastson = root->lastson;
+		f->sonsnum = root->sonsnum;
+		f->kids = root->kids;
+		f->kidscap = root->kidscap;
+		for (t = f->son; t != NULL; t = t->bro) {
+			jrw_wr(&t->lock);		// father_lock() counts on a held son keeping its father
+			jset(t->father, f);
+			node_unlock(t);
+		}
+		root->son = NULL;
+		root->lastson = NULL;
+		root->sonsnum = 0;
+		if (root->kidscap != 0)
+			jsetrel(root->kids, kids);		// same capacity, as lock free probes may hold the old one
+		else
+			free(kids);
+		seq_write_end(root);
+		node_unlock(root);
+		jset(f->dead, 1);
+		reap_push(f);
+		return 0;
+	}
+	f = walk_locked(path, n - 1, 1);
+	if (f == NULL)
+		return -1;
+	t = path_kid(f, last, lastlen);
+	if (t == NULL) {
+		node_unlock(f);
+		return -1;
+	}
+	jrw_wr(&t->lock);
+	node_detach(f, t);
+	*lsn = journal_add(JOP_DELETE_R, path, NULL, NULL, 0, 0);
+	node_unlock(t);
+	node_unlock(f);
+	reap_push(t);
+	return 0;
+
+}
+
+long jfs_delete_async(const char * path) {
+	uint64_t lsn = 0;
+	int held = journal_enter(0);
+	long r = held < 0 ? -1 : delete_async_do(path, &lsn);
+	if (journal_leave(held, lsn) != 0)
+		r = -1;
+	return r;
+}
+
+void jfs_delete_async_wait(void) {
+#ifdef JAMRAMFS_THREADS
+	jmx_lock(&reaplock);
+	while (reapnum != 0 || reapbusy)
+		pthread_cond_wait(&reapidle, &reaplock);
+	jmx_unlock(&reaplock);
+#endif
+}
+
+//####################################################################################
+
+/**
+ makes n, a clone of file t (held exclusive), use t's content as it is
+ @return 0 okay, -1 out of memory
+*/
+static int share_with(node * t, node * n) {
+	if (t->ext != NULL) {		// extents are shared one by one
+		size_t sz = sizeof(struct jexttab) + (t->ext->n - 1) * sizeof(struct jextent *);
+		size_t i;
+		struct jexttab * tab = (struct jexttab *) malloc(sz);
+		if (tab == NULL)
+			return -1;
+		memcpy(tab, t->ext, sz);
+		for (i = 0; i < tab->n; i++)
+			if (tab->e[i] != NULL)
+				jadd(tab->e[i]->refs, 1);
+		n->ext = tab;
+		n->datasz = t->datasz;
+		return 0;
+	}
+	if (t->datacap != 0 && t->maps != 0) {	// a jmap() view keeps t's buffer t's own, n gets a copy
+		if (t->datasz == 0)
+			return 0;
+		n->data = t->data;		// lent for data_reserve() to copy, or cut up, from
+		n->datasz = t->datasz;
+		if (data_reserve(n, n->datasz) != 0) {
+			n->data = NULL;
+			n->datasz = 0;
+			return -1;
+		}
+		return 0;
+	}
+	if (t->datacap != 0) {		// t still owns its buffer: hand it to a jshare
+		struct jshare * sh = (struct jshare *) malloc(sizeof(struct jshare));
+		if (sh == NULL)
+			return -1;
+		sh->refs = 1;
+		sh->data = t->data;
+		sh->cap = t->datacap;
+		t->share = sh;
+		t->datacap = 0;
+	}
+	if (t->share != NULL)
+		jadd(t->share->refs, 1);
+	n->share = t->share;		// NULL for nothing at all, or bytes of the mounted image
+	n->data = t->data;
+	n->datasz = t->datasz;
+	return 0;
+}
+
+struct cloneframe {
+	node * dir;
+	node * next;	// next son to clone
+	node * copy;
+};
+
+/**
+ copies T, held exclusive by the caller and let go here, and all
+ below it into a new subtree hanging from no one, named name.
+ Directories are held shared on the way down, a file exclusive while
+ its content is shared.
+ @param excl
+ hold directories exclusive too, to copy up a mounted image's part first
+ @param num
+ receives the number of resources copied
+ @return the new subtree's top, NULL when out of memory
+*/
+static node * clone_tree(node * T, const char * name, int excl, long * num) {
+	struct cloneframe * st;
+	size_t depth = 0, stcap = 16;
+	node * top;
+	int fail = 0;
+
+	*num = 0;
+	st = (struct cloneframe *) malloc(stcap * sizeof(struct cloneframe));
+	top = st == NULL ? NULL : create_element(NULL, NULL, (char *) name, T->type);
+	if (top == NULL || (T->type == FILE_T && share_with(T, top) != 0)) {
+		if (top != NULL)
+			destroy_element(top);
+		free(st);
+		node_unlock(T);
+		return NULL;
+	}
+	*num = 1;
+	if (T->type == DIR_T) {
+		if (excl && img_kids_make(T) != 0)
+			fail = 1;
+		st[0].dir = T;
+		st[0].next = T->son;
+		st[0].copy = top;
+		depth = 1;
+	}
+	else
+		node_unlock(T);
+	while (depth != 0 && !fail) {
+		struct cloneframe * f = &st[depth - 1];
+		node * c = f->next;
+		node * n;
+		if (c == NULL) {
+			node_unlock(f->dir);
+			depth--;
+			continue;
+		}
+		f->next = c->bro;
+		if (c->type == DIR_T && !excl) jrw_rd(&c->lock); else jrw_wr(&c->lock);
+		n = create_element(NULL, f->copy, c->name, c->type);
+		if (n == NULL || (c->type == FILE_T && share_with(c, n) != 0)
+		|| son_link(f->copy, n) != 0) {		// the copy is private, no lock needed
+			if (n != NULL)
+				destroy_element(n);
+			node_unlock(c);
+			fail = 1;
+			break;
+		}
+		(*num)++;
+		if (c->type != DIR_T) {
+			node_unlock(c);
+			continue;
+		}
+		if (excl && img_kids_make(c) != 0) {
+			node_unlock(c);
+			fail = 1;
+			break;
+		}
+		if (c->son == NULL) {
+			node_unlock(c);
+			continue;
+		}
+		if (depth == stcap) {
+			struct cloneframe * s = (struct cloneframe *) realloc(st, stcap * 2 * sizeof(struct cloneframe));
+			if (s == NULL) {
+				node_unlock(c);
+				fail = 1;
+				break;
+			}
+			st = s;
+			stcap *= 2;
+		}
+		st[depth].dir = c;
+		st[depth].next = c->son;
+		st[depth].copy = n;
+		depth++;
+	}
+	while (depth != 0)
+		node_unlock(st[--depth].dir);
+	free(st);
+	if (fail) {
+		jrw_wr(&top->lock);
+		subtree_free(top, 0);
+		return NULL;
+	}
+	return top;
+}
+
+static long clone_do(const char * src, const char * dst, uint64_t * lsn) {
+
+	node * t;
+	node * f;
+	node * top;
+	const char * last;
+	size_t lastlen;
+	char name[NAME_L];
+	int n, excl;
+	long num;
+
+	if (src == NULL || dst == NULL)
+		return -1;
+	n = path_last(dst, &last, &lastlen);
+	if (n == 0 || lastlen >= NAME_L)
+		return -1;
+	memcpy(name, last, lastlen);
+	name[lastlen] = '\0';
+	excl = jgetacq(imgbase) != NULL;
+	t = path_lock(src, 1);
+	if (t == NULL)
+		return -1;
+	/*--built apart from the tree, so dst may even lie inside src--*/
+	top = clone_tree(t, name, excl, &num);
+	if (top == NULL)
+		return -1;
+	f = walk_locked(dst, n - 1, 1);
+	if (f == NULL || f->type != DIR_T || f->sonsnum == MAX_SONS
+	|| kid_find(f, last, lastlen) != NULL || img_kid_find(f, last, lastlen) != 0) {
+		if (f != NULL)
+			node_unlock(f);
+		jrw_wr(&top->lock);
+		subtree_free(top, 0);
+		return -1;
+	}
+	top->father = f;
+	if (son_link(f, top) != 0) {
+		node_unlock(f);
+		top->father = NULL;
+		jrw_wr(&top->lock);
+		subtree_free(top, 0);
+		return -1;
+	}
+	*lsn = journal_add(JOP_CLONE, src, dst, NULL, 0, 0);
+	node_unlock(f);
+	return num;
+
+}
+
+long jfs_clone(const char * src, const char * dst) {
+	uint64_t lsn = 0;
+	int held = journal_enter(1);	// replay clones what src holds at this point of the log
+	long r = held < 0 ? -1 : clone_do(src, dst, &lsn);
+	if (journal_leave(held, lsn) != 0)
+		r = -1;
+	return r;
+}
+
+//####################################################################################
+
+void insert_in_order(char * path) {
+
+	struct result * new, * curr, * prev;
+	size_t l = strlen(&path[1]);
+
+	new = (struct result *) arena_alloc(sizeof(struct result) + l);
+	if (new == NULL)
+		return;
+	memcpy(new->p, &path[1], l + 1);
+	jmx_lock(&resultslock);
+	prev = NULL;
+	curr = results;
+
+	while (curr != NULL && strcmp(new->p, curr->p) > 0) {
+		 prev = curr;
+		 curr = curr->next;
+	}
+
+	if (prev == NULL) {
+		new->next = results;
+		results = new;
+	}
+	else {
+		prev->next = new;
+		new->next = curr;
+	}
+	jmx_unlock(&resultslock);
+
+	return;
+}
+
+//####################################################################################
+
+/*--
+ find: an explicit stack of directories, each held shared while its
+ sons are visited, and one path buffer grown as needed, so memory is
+ bounded by the depth and the longest path, not by the matches
+--*/
+struct findframe {
+	node * dir;
+	node * next;	// next son to visit
+	size_t len;		// length of dir's path in the buffer
+};
+
+/**
+ reports every resource named name at or below T to cb, by walking
+ the tree. T is held shared by the caller and let go here.
+ @param tpath
+ T's path, the matches' paths are built on it
+ @param glob
+ name is a pattern, see glob_match()
+ @return matches reported, -1 when out of memory
+*/
+static long find_walk(node * T, const char * tpath, const char * name, int glob, jfs_find_cb cb, void * arg) {
+	struct findframe * st;
+	size_t depth = 0, stcap = 16;
+	char * path;
+	size_t pathcap, len = strlen(tpath);
+	long found = 0;
+
+	pathcap = len + NAME_L + 1;
+	path = (char *) malloc(pathcap);
+	st = (struct findframe *) malloc(stcap * sizeof(struct findframe));
+	if (path == NULL || st == NULL) {
+		free(path);
+		free(st);
+		node_unlock(T);
+		return -1;
+	}
+	memcpy(path, tpath, len + 1);
+	if (name_match(T->name, name, glob)) {
+		found++;
+		if (cb(path, arg) != 0) {
+			node_unlock(T);
+			free(path);
+			free(st);
+			return found;
+		}
+	}
+	st[depth].dir = T;
+	st[depth].next = T->son;
+	st[depth].len = len;
+	depth++;
+	while (depth != 0) {
+		struct findframe * f = &st[depth - 1];
+		node * c = f->next;
+		size_t nlen;
+		if (c == NULL) {
+			node_unlock(f->dir);
+			depth--;
+			continue;
+		}
+		f->next = c->bro;
+		nlen = strlen(c->name);
+		if (f->len + nlen + 2 > pathcap) {
+			char * p = (char *) realloc(path, pathcap * 2 + nlen);
+			if (p == NULL) {
+				found = -1;
+				break;
+			}
+			path = p;
+			pathcap = pathcap * 2 + nlen;
+		}
+		path[f->len] = '/';
+		memcpy(path + f->len + 1, c->name, nlen + 1);
+		if (name_match(c->name, name, glob)) {
+			found++;
+			if (cb(path, arg) != 0)
+				break;
+		}
+		if (c->type != DIR_T)
+			continue;
+		jrw_rd(&c->lock);
+		if (c->son == NULL) {
+			node_unlock(c);
+			continue;
+		}
+		if (depth == stcap) {
+			struct findframe * n = (struct findframe *) realloc(st, stcap * 2 * sizeof(struct findframe));
+			if (n == NULL) {
+				node_unlock(c);
+				found = -1;
+				break;
+			}
+			st = n;
+			stcap *= 2;
+			f = &st[depth - 1];
+		}
+		st[depth].dir = c;
+		st[depth].next = c->son;
+		st[depth].len = f->len + 1 + nlen;
+		depth++;
+	}
+	while (depth != 0)		// stopped early, let go of what is still held
+		node_unlock(st[--depth].dir);
+	free(path);
+	free(st);
+	return found;
+}
+
+/*--matches kept for a sorted find, handed on after one qsort()--*/
+struct findbag {
+	char ** v;
+	size_t n;
+	size_t cap;
+	size_t skip;	// leading characters not kept
+};
+
+static int find_collect(const char * path, void * arg) {
+	struct findbag * b = (struct findbag *) arg;
+	size_t l = strlen(path + b->skip);
+	char * p;
+	if (b->n == b->cap) {
+		size_t cap = b->cap ? b->cap * 2 : 64;
+		char ** v = (char **) realloc(b->v, cap * sizeof(char *));
+		if (v == NULL)
+			return -1;
+		b->v = v;
+		b->cap = cap;
+	}
+	p = (char *) arena_alloc(l + 1);
+	if (p == NULL)
+		return -1;
+	memcpy(p, path + b->skip, l + 1);
+	b->v[b->n++] = p;
+	return 0;
+}
+
+static int find_cmp(const void * a, const void * b) {
+	return strcmp(*(char * const *) a, *(char * const *) b);
+}
+
+static void find_bag_free(struct findbag * b, size_t from) {
+	size_t i;
+	for (i = from; i < b->n; i++)
+		arena_free(b->v[i], strlen(b->v[i]) + 1);
+	free(b->v);
+}
+
+/**
+ an exact name, or any pattern from the root, goes through the index;
+ a pattern below the root walks just that subtree instead of every
+ distinct name. t is held shared and let go here.
+*/
+static long find_any(node * t, const char * tpath, const char * name, jfs_find_cb cb, void * arg) {
+	long r;
+	int glob = strpbrk(name, "*?") != NULL;
+	if (glob && t != root)
+		return find_walk(t, tpath, name, 1, cb, arg);
+	r = name_lookup(t, tpath, name, glob, 0, cb, arg);
+	node_unlock(t);
+	return r;
+}
+
+static long find_do(const char * path, const char * name, int sorted, jfs_find_cb cb, void * arg) {
+	node * t;
+	char * tpath;
+	long r;
+	size_t i;
+	struct findbag bag = { NULL, 0, 0, 0 };
+
+	if (path == NULL || name == NULL || cb == NULL)
+		return -1;
+	tpath = (char *) malloc(strlen(path) + 1);
+	if (tpath == NULL)
+		return -1;
+	path_canon(tpath, path);
+	t = path_lock(path, 0);
+	if (t == NULL) {
+		free(tpath);
+		return -1;
+	}
+	if (!sorted) {
+		int was = find_enter();
+		r = find_any(t, tpath, name, cb, arg);
+		find_leave(was);
+		free(tpath);
+		return r;
+	}
+	r = find_any(t, tpath, name, find_collect, &bag);
+	free(tpath);
+	if (r < 0 || (size_t) r != bag.n) {	// the bag ran out of memory
+		find_bag_free(&bag, 0);
+		return -1;
+	}
+	if (bag.n > 1)		// bag.v is still NULL with no match
+		qsort(bag.v, bag.n, sizeof(char *), find_cmp);
+	r = 0;
+	for (i = 0; i < bag.n; i++) {
+		char * p = bag.v[i];
+		int stop = cb(p, arg);
+		arena_free(p, strlen(p) + 1);
+		r++;
+		if (stop != 0) {
+			i++;
+			break;
+		}
 	}
+	find_bag_free(&bag, i);
+	return r;
+}
 
-	f = t;
-	t = t->son;
-	if (strcmp(t->name, name) == 0) {
-		return NO;
+long jfs_find(const char * path, const char * name, int sorted, jfs_find_cb cb, void * arg) {
+	uint64_t t0 = stat_begin();
+	long r = find_do(path, name, sorted, cb, arg);
+	stat_end(JST_FIND, t0);
+	return r;
+}
+
+//####################################################################################
+
+/**
+ adds to results every resource named name at or below T, whose path
+ is taken to be temp_path + "/" + T->name; a match is not looked into.
+ Answered from the basename index, the tree is not walked.
+*/
+void find(node * T, char * name, char * temp_path) {
+
+	struct findbag bag = { NULL, 0, 0, 1 };
+	struct result * head = NULL;
+	struct result ** tail = &head;
+	struct result * prev, * curr;
+	size_t i, l;
+	char * tpath;
+	long r;
+
+	l = strlen(temp_path);
+	tpath = (char *) malloc(l + strlen(T->name) + 2);
+	if (tpath == NULL)
+		return;
+	memcpy(tpath, temp_path, l);
+	tpath[l] = '/';
+	strcpy(tpath + l + 1, T->name);
+	r = name_lookup(T, tpath, name, 0, 1, find_collect, &bag);
+	free(tpath);
+	if (r < 0 || bag.n == 0) {
+		find_bag_free(&bag, 0);
+		return;
 	}
-	while(t->bro != NULL) {
-		t = t->bro;
-		if (strcmp(t->name, name) == 0) {
-			return NO;
+	if (bag.n > 1)		// bag.v is still NULL with no match
+		qsort(bag.v, bag.n, sizeof(char *), find_cmp);
+	/*--to result records, then one merge into the sorted results--*/
+	for (i = 0; i < bag.n; i++) {
+		struct result * new;
+		l = strlen(bag.v[i]);
+		new = (struct result *) arena_alloc(sizeof(struct result) + l);
+		if (new == NULL)
+			break;
+		memcpy(new->p, bag.v[i], l + 1);
+		*tail = new;
+		tail = &new->next;
+	}
+	*tail = NULL;
+	find_bag_free(&bag, 0);
+	jmx_lock(&resultslock);
+	prev = NULL;
+	curr = results;
+	while (head != NULL) {
+		struct result * h = head;
+		while (curr != NULL && strcmp(h->p, curr->p) > 0) {
+			prev = curr;
+			curr = curr->next;
 		}
+		head = h->next;
+		h->next = curr;
+		if (prev == NULL)
+			results = h;
+		else
+			prev->next = h;
+		prev = h;
 	}
+	jmx_unlock(&resultslock);
 
-	f->sonsnum++;
-	new = create_element(t, f, name, res_type);
-	t->bro = new;
-	new->prev = t;
-	new->father = f;
-	return OK;
 }
 
 //####################################################################################
 
-enum returnCode read_file(char * path, char * name, char * contenuto) {
+struct result * print_results_and_free(struct result * L) {
+	// ongi nodo della lista dei risultati della find contiene il percorso intero della risorse nel campo 'n'
+	struct result * prev;
 
-	node * t;
+	prev = NULL;
+	// scorro la lista dei risultati della find stampando ed eliminando ogni nodo
+	while (L != NULL) {
+		printf("ok %s\n", L->p);
+		prev = L;
+		L = L->next;
+		arena_free(prev, sizeof(struct result) + strlen(prev->p));
+	}
+
+	if ( L == NULL)
+		return L;
+	else
+		return NULL;
+}
+
+//####################################################################################
+
+/*--
+ parallel walks: every worker owns a deque of directories still to be
+ visited, takes its own newest first and, when it has none, steals the
+ oldest of another's. A queued directory is pinned (pins, taken while
+ its father or itself is locked) so nothing deletes it before a worker
+ gets there. Without JAMRAMFS_THREADS the caller is the only worker.
+--*/
+struct jtask {
+	struct jtask * up;	// delete: the directory above, finished after this one
+	node * dir;
+	char * path;		// find: the directory's full path
+	long pending;		// delete: its own visit plus the subdirectories queued
+};
+
+struct jdeque {
+	jmutex lock;
+	struct jtask ** t;
+	size_t head;		// stolen from here
+	size_t tail;		// pushed and popped here
+	size_t cap;
+};
+
+struct jpool {
+	struct jdeque * q;
+	int n;
+	long outstanding;	// tasks queued or running
+	int failed;
+	void (*run)(struct jpool * p, int self, struct jtask * t);
+	void * ctx;
+};
+
+struct jworker {
+	struct jpool * p;
+	int self;
+};
+
+/**@return 0 okay, -1 out of memory*/
+static int pool_push(struct jpool * p, int self, struct jtask * t) {
+	struct jdeque * q = &p->q[self];
+	jmx_lock(&q->lock);
+	if (q->tail == q->cap) {
+		if (q->head != 0) {
+			memmove(q->t, q->t + q->head, (q->tail - q->head) * sizeof(struct jtask *));
+			q->tail -= q->head;
+			q->head = 0;
+		}
+		else {
+			size_t cap = q->cap ? q->cap * 2 : 64;
+			struct jtask ** n = (struct jtask **) realloc(q->t, cap * sizeof(struct jtask *));
+			if (n == NULL) {
+				jmx_unlock(&q->lock);
+				return -1;
+			}
+			q->t = n;
+			q->cap = cap;
+		}
+	}
+	jadd(p->outstanding, 1);
+	q->t[q->tail++] = t;
+	jmx_unlock(&q->lock);
+	return 0;
+}
+
+static struct jtask * pool_take(struct jpool * p, int self) {
+	struct jtask * t = NULL;
+	struct jdeque * q = &p->q[self];
+	int i;
+	jmx_lock(&q->lock);
+	if (q->tail > q->head)
+		t = q->t[--q->tail];
+	jmx_unlock(&q->lock);
+	for (i = 1; t == NULL && i < p->n; i++) {
+		q = &p->q[(self + i) % p->n];
+		jmx_lock(&q->lock);
+		if (q->tail > q->head)
+			t = q->t[q->head++];
+		jmx_unlock(&q->lock);
+	}
+	return t;
+}
+
+static void * pool_worker(void * arg) {
+	struct jworker * w = (struct jworker *) arg;
+	struct jpool * p = w->p;
+	struct jtask * t;
+	for (;;) {
+		t = pool_take(p, w->self);
+		if (t != NULL) {
+			p->run(p, w->self, t);
+			jadd(p->outstanding, -1);
+			continue;
+		}
+		if (jgetacq(p->outstanding) == 0)
+			break;
+#ifdef JAMRAMFS_THREADS
+		sched_yield();
+#endif
+	}
+	return NULL;
+}
 
-	t = path_travel(path);
+/**default worker count, one per online processor*/
+static int pool_cpus(void) {
+#ifdef JAMRAMFS_THREADS
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	return n > 0 ? (int) n : 1;
+#else
+	return 1;
+#endif
+}
+
+/**
+ runs first and everything it queues on up to nthreads workers, the
+ caller being one of them, and comes back once all are done
+ @return 0 okay, -1 out of memory before anything ran
+*/
+static int pool_run(struct jpool * p, int nthreads, struct jtask * first) {
+	struct jworker * w;
+	int i;
+#ifdef JAMRAMFS_THREADS
+	pthread_t * th;
+	int started = 0;
+	if (nthreads <= 0)
+		nthreads = pool_cpus();
+#else
+	nthreads = 1;
+#endif
+	p->n = nthreads;
+	p->outstanding = 0;
+	p->failed = 0;
+	p->q = (struct jdeque *) calloc(nthreads, sizeof(struct jdeque));
+	w = (struct jworker *) malloc(nthreads * sizeof(struct jworker));
+	if (p->q == NULL || w == NULL) {
+		free(p->q);
+		free(w);
+		return -1;
+	}
+	for (i = 0; i < nthreads; i++) {
+#ifdef JAMRAMFS_THREADS
+		pthread_mutex_init(&p->q[i].lock, NULL);
+#endif
+		w[i].p = p;
+		w[i].self = i;
+	}
+	if (pool_push(p, 0, first) != 0) {
+		free(p->q);
+		free(w);
+		return -1;
+	}
+#ifdef JAMRAMFS_THREADS
+	th = (pthread_t *) malloc(nthreads * sizeof(pthread_t));
+	if (th != NULL)
+		for (i = 1; i < nthreads; i++, started++)
+			if (pthread_create(&th[i], NULL, pool_worker, &w[i]) != 0)
+				break;	// fewer workers, they steal from each other anyway
+	pool_worker(&w[0]);
+	for (i = 1; i <= started; i++)
+		pthread_join(th[i], NULL);
+	free(th);
+	for (i = 0; i < nthreads; i++)
+		pthread_mutex_destroy(&p->q[i].lock);
+#else
+	pool_worker(&w[0]);
+#endif
+	for (i = 0; i < nthreads; i++)
+		free(p->q[i].t);
+	free(p->q);
+	free(w);
+	return 0;
+}
+
+//####################################################################################
+
+struct findpar {
+	jfs_match_fn match;
+	void * marg;
+	struct findbag * bags;	// one per worker
+};
+
+/**match() on file t, held at least shared; content in extents goes as a copy*/
+static int file_match(jfs_match_fn match, const char * path, node * t, void * marg) {
+	void * copy;
+	int r;
+	if (t->ext == NULL)
+		return match(path, t->name, 0, t->data, t->datasz, marg);
+	copy = malloc(t->datasz ? t->datasz : 1);
+	if (copy == NULL)
+		return 0;
+	data_get(t, 0, copy, t->datasz);
+	r = match(path, t->name, 0, copy, t->datasz, marg);
+	free(copy);
+	return r;
+}
+
+/**@return non zero when c, whose parent is locked, matches*/
+static int findpar_test(struct findpar * fp, node * c, const char * path) {
+	int r, was = find_enter();
+	if (c->type != FILE_T)
+		r = fp->match(path, c->name, 1, NULL, 0, fp->marg);
+	else {
+		jrw_rd(&c->lock);
+		r = file_match(fp->match, path, c, fp->marg);
+		node_unlock(c);
+	}
+	find_leave(was);
+	return r;
+}
+
+static void findpar_run(struct jpool * p, int self, struct jtask * t) {
+	struct findpar * fp = (struct findpar *) p->ctx;
+	node * d = t->dir;
+	node * c;
+	size_t len = strlen(t->path);
+	char * path = (char *) malloc(len + NAME_L + 1);
+
+	if (path == NULL) {
+		jset(p->failed, 1);
+		node_unpin(d);
+		free(t->path);
+		free(t);
+		return;
+	}
+	memcpy(path, t->path, len);
+	jrw_rd(&d->lock);
+	for (c = d->son; c != NULL; c = c->bro) {
+		struct jtask * n;
+		path[len] = '/';
+		strcpy(path + len + 1, c->name);
+		if (findpar_test(fp, c, path) && find_collect(path, &fp->bags[self]) != 0)
+			jset(p->failed, 1);
+		if (c->type != DIR_T)
+			continue;
+		n = (struct jtask *) malloc(sizeof(struct jtask));
+		if (n != NULL)
+			n->path = (char *) malloc(len + strlen(c->name) + 2);
+		if (n == NULL || n->path == NULL) {
+			free(n);
+			jset(p->failed, 1);
+			continue;
+		}
+		strcpy(n->path, path);
+		n->dir = c;
+		n->up = NULL;
+		jadd(c->pins, 1);
+		if (pool_push(p, self, n) != 0) {
+			jadd(c->pins, -1);
+			free(n->path);
+			free(n);
+			jset(p->failed, 1);
+		}
+	}
+	node_unlock(d);
+	node_unpin(d);
+	free(path);
+	free(t->path);
+	free(t);
+}
+
+long jfs_find_par(const char * path, jfs_match_fn match, void * marg, jfs_find_cb cb, void * arg, int nthreads) {
+	struct findpar fp;
+	struct findbag all = { NULL, 0, 0, 0 };
+	struct jpool p;
+	struct jtask * first = NULL;
+	node * t;
+	char * tpath;
+	int nb, i, was, failed = 0;
+	long r = 0;
+	size_t k;
 
+	if (path == NULL || match == NULL || cb == NULL)
+		return -1;
+	nb = nthreads > 0 ? nthreads : pool_cpus();
+#ifndef JAMRAMFS_THREADS
+	nb = 1;
+#endif
+	fp.match = match;
+	fp.marg = marg;
+	fp.bags = (struct findbag *) calloc(nb, sizeof(struct findbag));
+	tpath = (char *) malloc(strlen(path) + 1);
+	if (fp.bags == NULL || tpath == NULL) {
+		free(fp.bags);
+		free(tpath);
+		return -1;
+	}
+	path_canon(tpath, path);
+	t = path_lock(path, 0);
 	if (t == NULL) {
-		return NO;
+		free(fp.bags);
+		free(tpath);
+		return -1;
+	}
+	/*--the starting point is a candidate too--*/
+	was = find_enter();
+	if ((t->type == FILE_T ? file_match(match, tpath, t, marg)
+	                       : match(tpath, t->name, 1, NULL, 0, marg))
+	    && find_collect(tpath, &fp.bags[0]) != 0)
+		failed = 1;
+	find_leave(was);
+	if (t->type == DIR_T) {
+		first = (struct jtask *) malloc(sizeof(struct jtask));
+		if (first != NULL) {
+			first->dir = t;
+			first->path = tpath;
+			first->up = NULL;
+			jadd(t->pins, 1);
+		}
+		else
+			failed = 1;
+	}
+	node_unlock(t);
+	if (first != NULL) {
+		p.run = findpar_run;
+		p.ctx = &fp;
+		if (pool_run(&p, nb, first) != 0) {
+			node_unpin(t);
+			free(first);
+			failed = 1;
+		}
+		else {
+			tpath = NULL;	// the task owned it
+			failed |= p.failed;
+		}
+	}
+	free(tpath);
+	/*--one sorted run, so the order does not depend on the workers--*/
+	for (i = 0; i < nb; i++) {
+		struct findbag * b = &fp.bags[i];
+		if (!failed && b->n != 0) {
+			char ** v = (char **) realloc(all.v, (all.n + b->n) * sizeof(char *));
+			if (v != NULL) {
+				memcpy(v + all.n, b->v, b->n * sizeof(char *));
+				all.v = v;
+				all.n += b->n;
+				free(b->v);
+				continue;
+			}
+			failed = 1;
+		}
+		find_bag_free(b, 0);
+	}
+	free(fp.bags);
+	if (failed) {
+		find_bag_free(&all, 0);
+		return -1;
+	}
+	if (all.n > 1)		// all.v is still NULL with no match
+		qsort(all.v, all.n, sizeof(char *), find_cmp);
+	for (k = 0; k < all.n; k++) {
+		char * s = all.v[k];
+		int stop = cb(s, arg);
+		arena_free(s, strlen(s) + 1);
+		r++;
+		if (stop != 0) {
+			k++;
+			break;
+		}
 	}
+	find_bag_free(&all, k);
+	return r;
+}
 
-	if (strcmp(t->name, name) == 0 && t->type == FILE_T) {
-		strcpy(contenuto, t->data);
-		return OK;
+//####################################################################################
+
+/**
+ everything below t's directory has been dealt with once its pending
+ count drops to zero: the directory itself goes then, and that may in
+ turn finish the one above
+*/
+static void delpar_done(struct jpool * p, struct jtask * t) {
+	long * deleted = (long *) p->ctx;
+	while (jadd(t->pending, -1) == 0) {
+		struct jtask * up = t->up;
+		node * k = t->dir;
+		node * f;
+		if (up == NULL)
+			return;	// the caller's own, it finishes that one
+		f = father_lock(k);
+		if (f != NULL && delete_if_idle(f, k, 1))
+			jadd(*deleted, 1);
+		else {
+			if (f == NULL)	// cut off by a delete_r() meanwhile
+				node_unlock(k);
+			node_unpin(k);
+		}
+		if (f != NULL)
+			node_unlock(f);
+		free(t);
+		t = up;
+	}
+}
+
+static void delpar_run(struct jpool * p, int self, struct jtask * t) {
+	long * deleted = (long *) p->ctx;
+	node * k = t->dir;
+	node * c;
+	node * nx;
+	jrw_wr(&k->lock);
+	if (img_kids_make(k) != 0)		// what is only in a mounted image goes too
+		jset(p->failed, 1);
+	for (c = k->son; c != NULL; c = nx) {
+		nx = c->bro;
+		if (c->type == DIR_T) {
+			struct jtask * n = (struct jtask *) malloc(sizeof(struct jtask));
+			if (n == NULL) {
+				jset(p->failed, 1);
+				continue;
+			}
+			n->up = t;
+			n->dir = c;
+			n->path = NULL;
+			n->pending = 1;
+			jadd(c->pins, 1);
+			jadd(t->pending, 1);
+			if (pool_push(p, self, n) != 0) {
+				jadd(c->pins, -1);
+				jadd(t->pending, -1);
+				free(n);
+				jset(p->failed, 1);
+			}
+			continue;
+		}
+		jrw_wr(&c->lock);
+		if (delete_if_idle(k, c, 0))
+			jadd(*deleted, 1);
 	}
+	node_unlock(k);
+	delpar_done(p, t);
+}
 
-	return NO;
+static long delete_par_do(const char * path, int nthreads) {
+	struct jpool p;
+	struct jtask top;
+	node * f = NULL;
+	node * t;
+	const char * last;
+	size_t lastlen;
+	int n;
+	long deleted = 0;
+
+	if (path == NULL)
+		return -1;
+	n = path_last(path, &last, &lastlen);
+	if (n == 0) {	// the root stays, only what is in it goes
+		if (!root_ready())
+			return -1;
+		t = root;
+		jrw_wr(&t->lock);
+	}
+	else {
+		f = walk_locked(path, n - 1, 1);
+		if (f == NULL)
+			return -1;
+		t = path_kid(f, last, lastlen);
+		if (t == NULL) {
+			node_unlock(f);
+			return -1;
+		}
+		jrw_wr(&t->lock);
+		if (t->type != DIR_T) {
+			n = delete_if_idle(f, t, 0);
+			node_unlock(f);
+			return n;
+		}
+		node_unlock(f);
+	}
+	jadd(t->pins, 1);
+	node_unlock(t);
+	top.up = NULL;
+	top.dir = t;
+	top.path = NULL;
+	top.pending = 1;
+	p.run = delpar_run;
+	p.ctx = &deleted;
+	pool_run(&p, nthreads, &top);
+	if (f != NULL) {
+		f = father_lock(t);
+		if (f != NULL && delete_if_idle(f, t, 1)) {
+			node_unlock(f);
+			return deleted + 1;
+		}
+		if (f == NULL)
+			node_unlock(t);
+		else
+			node_unlock(f);
+	}
+	node_unpin(t);
+	return deleted;
+}
 
+long jfs_delete_par(const char * path, int nthreads) {
+	int held = journal_enter(0);
+	long r = held < 0 ? -1 : delete_par_do(path, nthreads);
+	if (journal_leave(held, held > 0 ? journal_tail() : 0) != 0)	// each deletion was logged on its own
+		r = -1;
+	return r;
 }
 
 //####################################################################################
 
-int write_file(char * path, char * name, const char * contenuto) {
+/*--the tables jfs_save() gathers while the contents go straight to the file--*/
+struct jimgout {
+	FILE * f;
+	struct jimgnode * nodes;
+	size_t nnodes, nodecap;
+	char * str;
+	size_t strsz, strcap;
+	uint64_t datasz;
+};
+
+/**@return the string's offset, -1 when out of memory or past what 32 bits can hold*/
+static long long img_str(struct jimgout * o, const char * s) {
+	size_t l = strlen(s) + 1;
+	size_t at = o->strsz;
+	if (at + l > 0xffffffffu)
+		return -1;
+	if (at + l > o->strcap) {
+		size_t cap = o->strcap ? o->strcap * 2 : 4096;
+		char * n;
+		while (cap < at + l)
+			cap *= 2;
+		n = (char *) realloc(o->str, cap);
+		if (n == NULL)
+			return -1;
+		o->str = n;
+		o->strcap = cap;
+	}
+	memcpy(o->str + at, s, l);
+	o->strsz += l;
+	return (long long) at;
+}
+
+/**writes file t's content, holes as zeros; @return 0 okay, -1 if a write failed*/
+static int img_data(struct jimgout * o, node * t, uint64_t * at) {
+	size_t off, c;
+	*at = o->datasz;
+	if (t->ext == NULL) {
+		if (t->datasz != 0 && fwrite(t->data, 1, t->datasz, o->f) != t->datasz)
+			return -1;
+	}
+	else for (off = 0; off < t->datasz; off += c) {
+		struct jextent * x = t->ext->e[off / JFS_EXTENT];
+		c = JFS_EXTENT - off % JFS_EXTENT;
+		if (c > t->datasz - off)
+			c = t->datasz - off;
+		if (fwrite(x != NULL ? x->d + off % JFS_EXTENT : jzero, 1, c, o->f) != c)
+			return -1;
+	}
+	o->datasz += t->datasz;
+	return 0;
+}
+
+/**adds t, held at least shared, as the next node record; @return its index, -1 on error*/
+static long img_node(struct jimgout * o, node * t, uint32_t father) {
+	struct jimgnode * r;
+	long long s;
+	if (o->nnodes == 0xffffffffu)
+		return -1;
+	if (o->nnodes == o->nodecap) {
+		size_t cap = o->nodecap ? o->nodecap * 2 : 256;
+		struct jimgnode * n = (struct jimgnode *) realloc(o->nodes, cap * sizeof(struct jimgnode));
+		if (n == NULL)
+			return -1;
+		o->nodes = n;
+		o->nodecap = cap;
+	}
+	s = img_str(o, t->name);
+	if (s < 0)
+		return -1;
+	r = &o->nodes[o->nnodes];
+	memset(r, 0, sizeof(*r));
+	r->name = (uint32_t) s;
+	r->father = father;
+	r->type = (uint32_t)(unsigned char) t->type;
+	if (t->type == FILE_T && img_data(o, t, &r->data) != 0)
+		return -1;
+	r->size = t->type == FILE_T ? t->datasz : 0;
+	return (long) o->nnodes++;
+}
+
+/**
+ the tree, walked as find_walk() does: the directories on the stack
+ are held shared, a file only while its content is copied out
+ @return 0 okay, -1 on error
+*/
+static int img_tree(struct jimgout * o) {
+	struct saveframe {
+		node * dir;
+		node * next;
+		uint32_t at;
+	} * st;
+	size_t depth = 0, stcap = 16;
+	int r = 0;
+
+	st = (struct saveframe *) malloc(stcap * sizeof(*st));
+	if (st == NULL)
+		return -1;
+	jrw_rd(&root->lock);
+	if (img_node(o, root, 0) < 0) {
+		node_unlock(root);
+		free(st);
+		return -1;
+	}
+	st[0].dir = root;
+	st[0].next = root->son;
+	st[0].at = 0;
+	depth = 1;
+	while (depth != 0) {
+		struct saveframe * f = &st[depth - 1];
+		node * c = f->next;
+		long at;
+		if (c == NULL) {
+			node_unlock(f->dir);
+			depth--;
+			continue;
+		}
+		f->next = c->bro;
+		jrw_rd(&c->lock);
+		at = img_node(o, c, f->at);
+		if (at < 0 || c->type != DIR_T || c->son == NULL) {
+			node_unlock(c);
+			if (at < 0) {
+				r = -1;
+				break;
+			}
+			continue;
+		}
+		if (depth == stcap) {
+			struct saveframe * n = (struct saveframe *) realloc(st, stcap * 2 * sizeof(*st));
+			if (n == NULL) {
+				node_unlock(c);
+				r = -1;
+				break;
+			}
+			st = n;
+			stcap *= 2;
+		}
+		st[depth].dir = c;
+		st[depth].next = c->son;
+		st[depth].at = (uint32_t) at;
+		depth++;
+	}
+	while (depth != 0)
+		node_unlock(st[--depth].dir);
+	free(st);
+	return r;
+}
+
+struct imgkid {
+	const char * name;
+	uint32_t i;
+};
+
+static int imgkid_cmp(const void * a, const void * b) {
+	return strcmp(((const struct imgkid *) a)->name, ((const struct imgkid *) b)->name);
+}
+
+/**
+ puts the node records, gathered parent first, in breadth first order
+ with each directory's sons together and sorted by name
+ @return 0 okay, -1 out of memory
+*/
+static int img_order(struct jimgout * o) {
+	size_t n = o->nnodes, i, q, at;
+	size_t * end = (size_t *) calloc(n, sizeof(size_t));		// sons grouped by father, where each group ends
+	uint32_t * by = (uint32_t *) malloc(n * sizeof(uint32_t));
+	uint32_t * order = (uint32_t *) malloc(n * sizeof(uint32_t));
+	uint32_t * newi = (uint32_t *) malloc(n * sizeof(uint32_t));
+	struct imgkid * k = (struct imgkid *) malloc(n * sizeof(struct imgkid));
+	struct jimgnode * out = (struct jimgnode *) malloc(n * sizeof(struct jimgnode));
+	int r = -1;
+
+	if (end == NULL || by == NULL || order == NULL || newi == NULL || k == NULL || out == NULL)
+		goto out;
+	for (i = 1; i < n; i++)
+		end[o->nodes[i].father]++;
+	for (i = 1; i < n; i++)
+		end[i] += end[i - 1];
+	for (i = n; i-- > 1; )		// backwards, so each group keeps the gathering order
+		by[--end[o->nodes[i].father]] = (uint32_t) i;
+	order[0] = 0;		// end[f] is now where f's group starts, and end[f + 1] where it ends
+	newi[0] = 0;
+	for (q = 0, at = 1; q < at; q++) {
+		uint32_t f = order[q];
+		size_t b = end[f], e = f + 1 < n ? end[f + 1] : n - 1, j;
+		for (j = b; j < e; j++) {
+			k[j - b].name = o->str + o->nodes[by[j]].name;
+			k[j - b].i = by[j];
+		}
+		qsort(k, e - b, sizeof(struct imgkid), imgkid_cmp);
+		o->nodes[f].kids = (uint32_t) at;
+		o->nodes[f].nkids = (uint32_t)(e - b);
+		for (j = 0; j < e - b; j++) {
+			order[at] = k[j].i;
+			newi[k[j].i] = (uint32_t) at;
+			at++;
+		}
+	}
+	for (i = 0; i < n; i++) {
+		out[i] = o->nodes[order[i]];
+		out[i].father = newi[out[i].father];
+		if (out[i].nkids == 0)
+			out[i].kids = 0;
+	}
+	free(o->nodes);
+	o->nodes = out;
+	out = NULL;
+	r = 0;
+out:
+	free(end);
+	free(by);
+	free(order);
+	free(newi);
+	free(k);
+	free(out);
+	return r;
+}
+
+/**
+ checks every record of an image as img_load_tree() takes it, all but
+ names repeated in a directory, counting each directory's sons in sons[]
+ @return 0 okay, -1 on a bad record
+*/
+static int img_recs_check(const struct jimghead * h, const char * img, uint32_t * sons) {
+	const struct jimgnode * rec = (const struct jimgnode *)(img + h->nodeoff);
+	uint64_t i;
+
+	for (i = 1; i < h->nnodes; i++) {
+		const char * name = img_string(h, img, rec[i].name);
+		size_t l;
+		if (rec[i].father >= i || (rec[i].father != 0 && rec[rec[i].father].type != DIR_T)
+		|| name == NULL || (l = strlen(name)) == 0 || l >= NAME_L || strchr(name, '/') != NULL
+		|| (rec[i].type != DIR_T && rec[i].type != FILE_T)
+		|| (rec[i].type == FILE_T && (rec[i].data > h->datasz || rec[i].size > h->datasz - rec[i].data))
+		|| ++sons[rec[i].father] > MAX_SONS)
+			return -1;
+	}
+	return 0;
+}
+
+/**
+ the whole image file in one read
+ @return the checked image, to be freed, or NULL
+*/
+static char * img_read(const char * path, struct jimghead * h, size_t * size) {
+	FILE * f;
+	char * img;
+	long sz;
+	f = fopen(path, "rb");
+	if (f == NULL)
+		return NULL;
+	if (fseek(f, 0, SEEK_END) != 0 || (sz = ftell(f)) < (long) sizeof(*h) || fseek(f, 0, SEEK_SET) != 0) {
+		fclose(f);
+		return NULL;
+	}
+	img = (char *) malloc((size_t) sz);
+	if (img == NULL || fread(img, 1, (size_t) sz, f) != (size_t) sz) {
+		free(img);
+		fclose(f);
+		return NULL;
+	}
+	fclose(f);
+	memcpy(h, img, sizeof(*h));
+	if (img_check(h, img, (size_t) sz) != 0) {
+		free(img);
+		return NULL;
+	}
+	*size = (size_t) sz;
+	return img;
+}
+
+/**@return 0 when the image at path would load into an empty tree, -1 if not*/
+static int img_verify(const char * path) {
+	struct jimghead h;
+	uint32_t * sons;
+	char * img;
+	size_t sz;
+	int r = -1;
+
+	img = img_read(path, &h, &sz);
+	if (img == NULL)
+		return -1;
+	sons = (uint32_t *) calloc(h.nnodes, sizeof(uint32_t));
+	if (sons != NULL)
+		r = img_recs_check(&h, img, sons);
+	free(sons);
+	free(img);
+	return r;
+
+}
+
+/**jfs_save() for a journal as well, which has the file synced before it replaces the old one*/
+static int img_save(const char * path, uint32_t tag) {
+
+	struct jimgout o;
+	struct jimghead h;
+	char * tmp;
+	size_t l;
+	int r = -1;
+
+	if (path == NULL || !root_ready() || jgetacq(imgbase) != NULL)
+		return -1;
+	l = strlen(path);
+	tmp = (char *) malloc(l + 5);
+	if (tmp == NULL)
+		return -1;
+	memcpy(tmp, path, l);
+	memcpy(tmp + l, ".tmp", 5);
+	memset(&o, 0, sizeof(o));
+	memset(&h, 0, sizeof(h));
+	o.f = fopen(tmp, "wb");
+	if (o.f == NULL) {
+		free(tmp);
+		return -1;
+	}
+	/*--the header goes first, written again at the end with the offsets filled in--*/
+	if (fwrite(&h, sizeof(h), 1, o.f) != 1)
+		goto out;
+	if (img_tree(&o) != 0 || img_order(&o) != 0)
+		goto out;
+	memcpy(h.magic, JIMG_MAGIC, 4);
+	h.version = JIMG_VERSION;
+	h.order = JIMG_ORDER;
+	h.tag = tag;
+	h.nnodes = o.nnodes;
+	h.dataoff = sizeof(h);
+	h.datasz = o.datasz;
+	h.nodeoff = (h.dataoff + h.datasz + 7) & ~(uint64_t) 7;	// the tables stay aligned
+	h.stroff = h.nodeoff + h.nnodes * sizeof(struct jimgnode);
+	h.strsz = o.strsz;
+	if (fwrite("\0\0\0\0\0\0\0", 1, (size_t)(h.nodeoff - h.dataoff - h.datasz), o.f) != h.nodeoff - h.dataoff - h.datasz
+	|| fwrite(o.nodes, sizeof(struct jimgnode), o.nnodes, o.f) != o.nnodes
+	|| fwrite(o.str, 1, o.strsz, o.f) != o.strsz
+	|| fseek(o.f, 0, SEEK_SET) != 0
+	|| fwrite(&h, sizeof(h), 1, o.f) != 1)
+		goto out;
+#ifdef JAMRAMFS_JOURNAL
+	if (tag != 0 && (fflush(o.f) != 0 || fsync(fileno(o.f)) != 0))
+		goto out;
+#endif
+	r = 0;
+out:
+	if (fclose(o.f) != 0)
+		r = -1;
+	if (r == 0 && tag != 0 && img_verify(tmp) != 0)	// the log goes once this is in, so it must load back
+		r = -1;
+	if (r == 0 && rename(tmp, path) != 0)	// an old image is only replaced by a whole new one
+		r = -1;
+	if (r != 0)
+		remove(tmp);
+	free(tmp);
+	free(o.nodes);
+	free(o.str);
+	return r;
+
+}
+
+int jfs_save(const char * path) {
+	return img_save(path, 0);
+}
+
+/**a content blob of the image, in a buffer of its own; @return 0 okay, -1 on error*/
+static int img_blob(const struct jimghead * h, const char * img, uint64_t off, uint64_t size, char ** d) {
+	*d = NULL;
+	if (off > h->datasz || size > h->datasz - off)
+		return -1;
+	if (size == 0)
+		return 0;
+	*d = (char *) malloc((size_t) size);
+	if (*d == NULL)
+		return -1;
+	memcpy(*d, img + h->dataoff + off, (size_t) size);
+	return 0;
+}
+
+/**
+ builds the image's tree under root, held exclusive and empty;
+ every directory's kids table is made at its final size up front
+ @return 0 okay, -1 on a bad image or out of memory, some nodes may be in
+*/
+static int img_load_tree(const struct jimghead * h, const char * img) {
+	const struct jimgnode * rec = (const struct jimgnode *)(img + h->nodeoff);
+	node ** at;
+	uint32_t * sons;
+	uint64_t i;
+	int r = 0;
+
+	at = (node **) malloc(h->nnodes * sizeof(node *));
+	sons = (uint32_t *) calloc(h->nnodes, sizeof(uint32_t));
+	if (at == NULL || sons == NULL) {
+		free(at);
+		free(sons);
+		return -1;
+	}
+	r = img_recs_check(h, img, sons);
+	at[0] = root;
+	for (i = 1; i < h->nnodes && r == 0; i++) {
+		node * f = at[rec[i].father];
+		const char * name = img_string(h, img, rec[i].name);
+		node * n;
+		if (kid_find(f, name, strlen(name)) != NULL) {
+			r = -1;
+			break;
+		}
+		if (f->kids == NULL) {
+			unsigned int cap = 8;
+			while (sons[rec[i].father] * 4 > cap * 3)
+				cap *= 2;
+			f->kids = (node **) calloc(cap, sizeof(node *));
+			if (f->kids == NULL) {
+				r = -1;
+				break;
+			}
+			jsetrel(f->kidscap, cap);
+		}
+		n = create_element(NULL, f, (char *) name, (char) rec[i].type);
+		if (n == NULL) {
+			r = -1;
+			break;
+		}
+		if (rec[i].type == FILE_T && rec[i].size > JFS_EXTENT) {
+			/*--cut up straight from the image, as if it had grown that big--*/
+			n->data = (char *) img + h->dataoff + rec[i].data;
+			n->datasz = (size_t) rec[i].size;
+			if (ext_reserve(n, n->datasz) != 0) {
+				n->data = NULL;
+				n->datasz = 0;
+				destroy_element(n);
+				r = -1;
+				break;
+			}
+		}
+		else if (rec[i].type == FILE_T) {
+			if (img_blob(h, img, rec[i].data, rec[i].size, &n->data) != 0) {
+				destroy_element(n);
+				r = -1;
+				break;
+			}
+			n->datasz = n->datacap = (size_t) rec[i].size;
+			stat_mem(0, (long) n->datacap);
+		}
+		if (son_link(f, n) != 0) {
+			destroy_element(n);
+			r = -1;
+			break;
+		}
+		at[i] = n;
+	}
+	free(at);
+	free(sons);
+	return r;
+}
 
-	node * t;
+/**jfs_load(), also giving back the image's tag*/
+static int img_load(const char * path, uint32_t * tag) {
 
-	t = path_travel(path);
+	struct jimghead h;
+	char * img;
+	size_t sz;
+	int r = -1;
 
-	if (t == NULL) {
+	if (path == NULL || !root_ready())
+		return -1;
+	img = img_read(path, &h, &sz);
+	if (img == NULL)
+		return -1;
+	jrw_wr(&root->lock);
+	if (root->son != NULL || imgbase != NULL) {
+		node_unlock(root);
+		free(img);
 		return -1;
 	}
-
-	if (strcmp(t->name, name) == 0 && t->type == FILE_T) {
-	//	contenuto[strlen(contenuto)-1] = '\0';
-		strcpy(t->data, contenuto);                    
-		return (int) strlen(t->data);
-	}
-
-	return -1;
+	r = img_load_tree(&h, img);
+	if (r != 0)		// all or nothing
+		subtree_free(root, 1);
+	else
+		node_unlock(root);
+	*tag = h.tag;
+	free(img);
+	return r;
 
 }
 
-//####################################################################################
+int jfs_load(const char * path) {
+	uint32_t tag;
+	if (jgetacq(jnon) || in_find())		// the journal would miss all of it
+		return -1;
+	return img_load(path, &tag);
+}
 
-enum returnCode delete(char * path, char * name) {
+int jfs_mount(const char * path) {
 
-		node * t;
+	struct jimghead h;
+	char * img;
+	size_t sz;
+	unsigned char * hidden;
+	int r = -1;
 
-		t = path_travel(path);
-		
-		if (t == NULL) {
-			return NO;
+	if (path == NULL || !root_ready() || jgetacq(jnon) || in_find())
+		return -1;
+#ifdef JAMRAMFS_MMAP
+	{
+		struct stat st;
+		void * m;
+		int fd = open(path, O_RDONLY);
+		if (fd < 0)
+			return -1;
+		if (fstat(fd, &st) != 0 || st.st_size < (off_t) sizeof(h)) {
+			close(fd);
+			return -1;
 		}
-		
-		if (t->type == DIR_T && t->sonsnum != 0) {
-			return NO;
+		sz = (size_t) st.st_size;
+		m = mmap(NULL, sz, PROT_READ, MAP_SHARED, fd, 0);	// shared, through the page cache
+		close(fd);
+		if (m == MAP_FAILED)
+			return -1;
+		img = (char *) m;
+		memcpy(&h, img, sizeof(h));
+		if (img_check(&h, img, sz) != 0) {
+			munmap(m, sz);
+			return -1;
 		}
-		
-		if (strcmp(t->name, name) == 0) {
-			//printf(" %d ", t->sonsnum);
-			//printf(" %s %s %d ", t->name, name, p_l);
-			
-
-			if (t->prev == NULL && t->bro == NULL) {			      // il nodo da eliminare e' l'unico della lista
-				t->father->son = NULL;
-			}
-			
-			else if (t->prev == NULL && t->bro != NULL) {		 	  // il nodo da eliminare e' in testa
-				t->father->son = t->bro;
-				t->bro->prev = NULL;
-			}
-
-			else if (t->prev != NULL && t->bro == NULL) {     // il nodo da eliminare e' in coda
-				t->prev->bro = NULL;
-			}
-			
-			else {
-				t->prev->bro = t->bro;    					  // il nodo da eliminare e' in mezzo
-				t->bro->prev = t->prev;
-			}
-			
-			t->father->sonsnum--;
-			t->father = NULL;
-			free(t);
-			return OK;
-	    }
+	}
+#else
+	img = img_read(path, &h, &sz);
+	if (img == NULL)
+		return -1;
+#endif
+	hidden = (unsigned char *) calloc((size_t) h.nnodes, 1);
+	if (hidden != NULL && ((const struct jimgnode *)(img + h.nodeoff))->type == DIR_T) {
+		jrw_wr(&root->lock);
+		if (root->son == NULL && imgbase == NULL) {
+			imghead = h;
+			imghidden = hidden;
+			jsetrel(imgbase, (const char *) img);
+			root->img = 1;
+			r = 0;
+		}
+		node_unlock(root);
+	}
+	if (r != 0) {
+		free(hidden);
+#ifdef JAMRAMFS_MMAP
+		munmap(img, sz);
+#else
+		free(img);
+#endif
+	}
+	return r;
 
-	return NO;
 }
 
 //####################################################################################
 
-int delete_r(node * R, int del_num) {
-
-	if (R->son != NULL)
-		del_num = del_num + delete_r(R->son, del_num);
+#ifdef JAMRAMFS_JOURNAL
+/*--
+ the log starts with a header whose generation must match the tag of
+ the snapshot beside it. A compaction writes the snapshot of the next
+ generation first and the new, empty log after; a crash in between
+ leaves a log older than the snapshot, which replay then passes over.
+--*/
+#define JRNL_MAGIC "JRJL"
 
-	if (R->bro != NULL)
-		del_num = del_num + delete_r(R->bro, del_num);
+struct jrnlhead {
+	char magic[4];
+	uint32_t order;
+	uint32_t gen;
+	uint32_t pad;
+};
 
-	if (R->prev == NULL && R->bro == NULL) {  		// il nodo da eliminare e' l'unico della lista
-		R->father->son = NULL;
+/**@return path with suffix added, to be freed, or NULL*/
+static char * journal_name(const char * path, const char * suffix) {
+	size_t l = strlen(path), k = strlen(suffix);
+	char * r = (char *) malloc(l + k + 1);
+	if (r != NULL) {
+		memcpy(r, path, l);
+		memcpy(r + l, suffix, k + 1);
 	}
+	return r;
+}
 
-	else if (R->prev != NULL && R->bro == NULL) {   // il nodo da eliminare e' in coda
-		R->prev->bro = NULL;
-	}
-	
-	else {										    // il nodo da eliminare e' in mezzo
-		R->prev->bro = R->bro;    					  
-		R->bro->prev = R->prev;
+/**fsync()s the directory holding path, so a rename into it lasts @return 0 okay, -1 on error*/
+static int journal_sync_dir(const char * path) {
+	const char * slash = strrchr(path, '/');
+	char * dir;
+	int fd, r;
+	if (slash == NULL)
+		dir = journal_name(".", "");
+	else {
+		size_t l = slash == path ? 1 : (size_t)(slash - path);
+		dir = (char *) malloc(l + 1);
+		if (dir != NULL) {
+			memcpy(dir, path, l);
+			dir[l] = '\0';
+		}
 	}
-	
-	R->father->sonsnum--;
-	R->father = NULL;
-	free(R);
-	return del_num;
+	if (dir == NULL)
+		return -1;
+	fd = open(dir, O_RDONLY);
+	free(dir);
+	if (fd < 0)
+		return -1;
+	r = fsync(fd);
+	close(fd);
+	return r == 0 ? 0 : -1;
+}
 
+/**empties the log file to just a header of generation gen @return 0 okay, -1 on error*/
+static int journal_head(int fd, uint32_t gen) {
+	struct jrnlhead h;
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, JRNL_MAGIC, 4);
+	h.order = JIMG_ORDER;
+	h.gen = gen;
+	if (ftruncate(fd, 0) != 0 || lseek(fd, 0, SEEK_SET) != 0
+	|| journal_write(fd, (const char *) &h, sizeof(h)) != 0 || fsync(fd) != 0)
+		return -1;
+	return 0;
 }
 
-//####################################################################################
+/**@return 0 if all n bytes were read, -1 on error or at the end*/
+static int journal_read(int fd, void * buf, size_t n) {
+	char * p = (char *) buf;
+	while (n) {
+		ssize_t r = read(fd, p, n);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0)
+			return -1;
+		p += r;
+		n -= (size_t) r;
+	}
+	return 0;
+}
 
-void insert_in_order(char * path) {
+/**
+ runs the change in one record again, through the public calls
+ @return 0, -1 if the record does not parse
+*/
+static int journal_apply(const char * rec, size_t len) {
+	int64_t num;
+	uint32_t al, bl;
+	uint64_t dl;
+	const char * a;
+	const char * b;
+	const char * d;
+	size_t off = 1 + 8;
 
-	struct result * new, * curr, * prev;
-	//int l;
+	if (len < off + 4)
+		return -1;
+	memcpy(&num, rec + 1, 8);
+	memcpy(&al, rec + off, 4);
+	off += 4;
+	if (al >= len - off || rec[off + al] != '\0')
+		return -1;
+	a = rec + off;
+	off += al + 1;
+	if (len - off < 4)
+		return -1;
+	memcpy(&bl, rec + off, 4);
+	off += 4;
+	if (bl >= len - off || rec[off + bl] != '\0')
+		return -1;
+	b = rec + off;
+	off += bl + 1;
+	if (len - off < 8)
+		return -1;
+	memcpy(&dl, rec + off, 8);
+	off += 8;
+	if (dl != len - off)
+		return -1;
+	d = rec + off;
+	/*--what the calls return is of no interest, each of them went through the first time--*/
+	switch (rec[0]) {
+	case JOP_CREATE:
+		if (dl != 1)
+			return -1;
+		create((char *) b, (char *) a, (int) num, d[0]);
+		break;
+	case JOP_WRITE:
+		write_file_n((char *) a, (char *) b, d, (size_t) dl);
+		break;
+	case JOP_DELETE:
+		delete((char *) a, (char *) b);
+		break;
+	case JOP_DELETE_R:
+		jfs_delete_r(a);
+		break;
+	case JOP_MKDIR:		// jkdir() now logs as a create()
+		jkdir(a, 0);
+		break;
+	case JOP_REMOVE:
+		jremove(a);
+		break;
+	case JOP_CLONE:
+		jfs_clone(a, b);
+		break;
+	default:
+		return -1;
+	}
+	return 0;
+}
 
-	new = (struct result *) malloc(sizeof(struct result));
-	strcpy(new->p, &path[1]);
-	prev = NULL;
-	curr = results;
+int jfs_journal_open(const char * path) {
 
-	while (curr != NULL && strcmp(new->p, curr->p) > 0) {
-		 prev = curr;
-		 curr = curr->next;
-	}
+	struct jrnlhead h;
+	char * snap;
+	char * rec = NULL;
+	size_t reccap = 0;
+	uint32_t tag = 0;
+	uint64_t size, good = sizeof(h);
+	int fd = -1, empty;
+	FILE * f;
 
-	if (prev == NULL) {
-		new->next = results;
-		results = new;
+	if (path == NULL || !root_ready() || jgetacq(jnon) || jgetacq(imgbase) != NULL)
+		return -1;
+	jrw_rd(&root->lock);
+	empty = root->son == NULL;
+	node_unlock(root);
+	if (!empty)
+		return -1;
+	snap = journal_name(path, ".snap");
+	if (snap == NULL)
+		return -1;
+	f = fopen(snap, "rb");
+	if (f != NULL) {
+		fclose(f);
+		if (img_load(snap, &tag) != 0)
+			goto fail;
 	}
-	else {
-		prev->next = new;
-		new->next = curr;
+	fd = open(path, O_RDWR | O_CREAT, 0644);
+	if (fd < 0)
+		goto fail;
+	size = (uint64_t) lseek(fd, 0, SEEK_END);
+	if (size >= sizeof(h) && (lseek(fd, 0, SEEK_SET) != 0 || journal_read(fd, &h, sizeof(h)) != 0
+	|| memcmp(h.magic, JRNL_MAGIC, 4) != 0 || h.order != JIMG_ORDER || h.gen > tag))
+		goto fail;			// not a log, or the snapshot it follows is gone
+	if (size < sizeof(h) || h.gen < tag) {	// new, or cut short while being made, or all in the snapshot
+		if (journal_head(fd, tag) != 0 || journal_sync_dir(path) != 0)
+			goto fail;
+		size = good;
+	}
+	while (good < size) {
+		uint32_t head[2];
+		if (journal_read(fd, head, 8) != 0 || head[0] > size - good - 8)
+			break;
+		if (head[0] > reccap) {
+			char * nr = (char *) realloc(rec, head[0]);
+			if (nr == NULL)
+				goto fail;
+			rec = nr;
+			reccap = head[0];
+		}
+		if (journal_read(fd, rec, head[0]) != 0 || kid_hash(rec, head[0]) != head[1]
+		|| journal_apply(rec, head[0]) != 0)
+			break;
+		good += 8 + head[0];
 	}
+	/*--a record torn by a crash mid write is cut off, so new ones follow the last whole one--*/
+	if (good != size && (ftruncate(fd, (off_t) good) != 0 || fsync(fd) != 0))
+		goto fail;
+	if (lseek(fd, (off_t) good, SEEK_SET) != (off_t) good)
+		goto fail;
+	free(rec);
+	free(snap);
+	jmx_lock(&jnlock);
+	jnpath = journal_name(path, "");
+	if (jnpath == NULL) {
+		jmx_unlock(&jnlock);
+		close(fd);
+		jfs_delete_r("/");		// whatever went in before the failure
+		return -1;
+	}
+	jnfd = fd;
+	jngen = tag;
+	jnsize = good;
+	jnadded = jnsynced = 0;
+	jnerr = 0;
+	jsetrel(jnon, 1);
+	jmx_unlock(&jnlock);
+	return 0;
+fail:
+	if (fd >= 0)
+		close(fd);
+	free(rec);
+	free(snap);
+	jfs_delete_r("/");		// whatever went in before the failure
+	return -1;
 
-	return;
 }
 
-//####################################################################################
+int jfs_journal_compact(void) {
 
-void find(node * T, char * name, char * temp_path) {
-	
-	char next_path[PATH_STRING_L];
-	
-	if (strcmp(T->name, name) == 0) {
-		//printf("ok %s\n", T->path);;
-		strcpy(next_path, temp_path);
-		strcat(next_path, "/");
-		strcat(next_path, name);
-		insert_in_order(next_path);
-		return;
+	char * snap = NULL;
+	char * tmp = NULL;
+	int fd = -1, saved = 0, r;
+
+	jrw_wr(&jnwlock);		// no change is half done, and none starts
+	jmx_lock(&jnlock);
+	if (!jnon) {
+		jmx_unlock(&jnlock);
+		jrw_unlock(&jnwlock);
+		return -1;
 	}
-	
-	if (T->bro != NULL) {
-		find(T->bro, name, temp_path);
+	journal_sync_locked(jnadded);		// the snapshot must not hold more than the log
+	r = jnerr ? -1 : 0;
+	jmx_unlock(&jnlock);
+	if (r == 0) {
+		r = -1;
+		snap = journal_name(jnpath, ".snap");
+		tmp = journal_name(jnpath, ".tmp");
+		if (snap != NULL && tmp != NULL && img_save(snap, jngen + 1) == 0 && journal_sync_dir(snap) == 0) {
+			saved = 1;
+			fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC, 0644);
+			if (fd >= 0 && journal_head(fd, jngen + 1) == 0 && rename(tmp, jnpath) == 0
+			&& journal_sync_dir(jnpath) == 0)
+				r = 0;
+		}
 	}
-
-	if (T->son != NULL) {
-		strcpy(next_path, temp_path);
-		strcat(next_path, "/");
-		strcat(next_path, T->name);
-		find(T->son, name, next_path);
+	jmx_lock(&jnlock);
+	if (r == 0) {
+		int old = jnfd;
+		jnfd = fd;
+		fd = old;
+		jngen++;
+		jnsize = sizeof(struct jrnlhead);
 	}
-	
-	return;
+	else if (saved)
+		jnerr = 1;		// the old log is behind the new snapshot now, nothing more would be replayed
+	jncompacting = 0;
+	jmx_unlock(&jnlock);
+	if (fd >= 0)
+		close(fd);
+	jrw_unlock(&jnwlock);
+	free(snap);
+	free(tmp);
+	return r;
+
 }
 
-//####################################################################################
+int jfs_journal_close(void) {
 
-struct result * print_results_and_free(struct result * L) {
-	// ongi nodo della lista dei risultati della find contiene il percorso intero della risorse nel campo 'n'
-	struct result * prev;
+	int r;
 
-	prev = NULL;
-	// scorro la lista dei risultati della find stampando ed eliminando ogni nodo
-	while (L != NULL) {
-		printf("ok %s\n", L->p);
-		prev = L;
-		L = L->next;
-		free(prev);
+	jrw_wr(&jnwlock);
+	jmx_lock(&jnlock);
+	if (!jnon) {
+		jmx_unlock(&jnlock);
+		jrw_unlock(&jnwlock);
+		return -1;
 	}
+	journal_sync_locked(jnadded);
+	r = jnerr ? -1 : 0;
+	if (close(jnfd) != 0)
+		r = -1;
+	jnfd = -1;
+	jsetrel(jnon, 0);
+	free(jnpath);
+	free(jnbuf);
+	free(jnspare);
+	jnpath = jnbuf = jnspare = NULL;
+	jnlen = jncap = jnsparecap = 0;
+	jnadded = jnsynced = jnsize = 0;
+	jnerr = 0;
+	jmx_unlock(&jnlock);
+	jrw_unlock(&jnwlock);
+	return r;
 
-	if ( L == NULL)
-		return L;
-	else
-		return NULL;
 }
+#else
+int jfs_journal_open(const char * path) {
+	(void) path;
+	return -1;
+}
+int jfs_journal_compact(void) {
+	return -1;
+}
+int jfs_journal_close(void) {
+	return -1;
+}
+#endif
 
 //####################################################################################
 //
@@ -704,18 +5324,18 @@ struct result * print_results_and_free(struct result * L) {
 //}
 
 #include <ctype.h>
-#include <core/Maths.h>
 
 #ifndef MAX_JFDS
 #define MAX_JFDS 100
 #endif
 JILE jfds[MAX_JFDS];
 JILE* jheadfree;
+static int jfdsready;
+static jmutex jfdlock = JMUTEX_INIT;	//jheadfree and the free/open state of jfds
 int jileno(const JILE* stream) {
 	if (stream >= &jfds[0]
-		&& stream <= &jfds[MAX_JFDS]) {
+		&& stream < &jfds[MAX_JFDS]) {
 		ptrdiff_t p = stream - &jfds[0];
-		p /= sizeof(JILE);
 		return (int)p;
 	}
 	return -1;
@@ -723,8 +5343,30 @@ int jileno(const JILE* stream) {
 JILE* jdopen(int fd, const char* mode) {
 	if (fd < 0) return NULL;
 	if (fd >= MAX_JFDS) return NULL;
+	if (!jfds[fd].isOpen) return NULL;
 	return &jfds[fd];
 }
+/**
+ brings the stream's view of the buffer (fileDataBuffer, sz, memsz)
+ up to date, since other streams or write_file() may have moved it
+*/
+static void jsync(JILE* stream, node* t) {
+	stream->fileDataBuffer = (unsigned char*)t->data;	//NULL for content in extents
+	stream->sz = t->datasz;
+	stream->memsz = t->ext ? t->ext->n * JFS_EXTENT : t->datacap;
+}
+/**
+ @return the file an open stream is bound to, locked shared or
+ exclusive and synced, or NULL
+*/
+static node* jlock(JILE* stream, int excl) {
+	node* t;
+	if (!stream || !stream->isOpen) return NULL;
+	t = (node*)stream->priv;
+	if (excl) jrw_wr(&t->lock); else jrw_rd(&t->lock);
+	jsync(stream, t);
+	return t;
+}
 JILE *jopen(const char *filename, const char *mode){
     JILE* ret;// = (JILE*)malloc(sizeof (JILE));
     int mod = mode[0];
@@ -747,7 +5389,7 @@ JILE *jopen(const char *filename, const char *mode){
             
         case JMODESTR_a:
             ret = jdopen(j_open(filename,J_WRONLY|J_CREAT),mode);
-            jseek(ret,0,SEEK_END);
+            if (ret) jseek(ret,0,SEEK_END);
             return ret;
             
         case JMODESTR_wp: return jdopen(j_open(filename,J_RDWR|J_CREAT|J_TRUNC),mode);
@@ -756,7 +5398,7 @@ JILE *jopen(const char *filename, const char *mode){
             
         case JMODESTR_ap:
             ret = jdopen(j_open(filename,J_RDWR|J_CREAT),mode);
-            jseek(ret,0,SEEK_END);
+            if (ret) jseek(ret,0,SEEK_END);
             return ret;
         default:
             return NULL;
@@ -767,6 +5409,7 @@ off_t jlseek(int fd, off_t offset, int whence) {
 	int r;
 	long int pos;
 	JILE* j = jdopen(fd, "a+");
+	if (!j) return (off_t)-1;
 	r = jseek(j,(long)offset,whence);
 	if (r < 0) {
 		return (off_t)-1;
@@ -775,7 +5418,7 @@ off_t jlseek(int fd, off_t offset, int whence) {
 	return (off_t)pos;
 }
 
-int jseek(JILE* stream, long offset, int whence) {
+static int jseek_locked(JILE* stream, node* t, long offset, int whence) {
 	ptrdiff_t bignum;
 	switch (whence) {
 	case SEEK_CUR:
@@ -790,34 +5433,24 @@ int jseek(JILE* stream, long offset, int whence) {
 		if (bignum < 0) bignum = 0;
 		if (bignum > (ptrdiff_t)stream->sz) {
 			//this is implementation dependant, we might support it?
-			if (bignum > (ptrdiff_t)stream->memsz) {
-				if (stream->areWeAllowedToReallocIt) {
-					void* newmem; size_t newsz;
-					newsz = roundSizeUpToMultiple4096(bignum);
-					newmem = realloc(stream->fileDataBuffer, newsz);
-					if (!newmem) {
-						fprintf(stderr, "failed allocation from %zu to %zu in jseek() past end\n", stream->memsz, newsz);
-						return -1;//return error condition
-					}
-					stream->fileDataBuffer = newmem;
-					stream->memsz = newsz;
-				}
-				else {
-					//well in that case it is an error condition again too
-					return -1;
-				}
-			}
-			else {
-				//expand within the current buffer, clear to zero first, for safety
-				memset(stream->fileDataBuffer + stream->sz, 0, bignum - stream->sz);
-				stream->sz = bignum;
+			if (!stream->allowedWrite)
+				return -1;//only a stream that may write grows the file, as for SEEK_SET
+			/*--grow the file itself, the gap reads back as zero--*/
+			seq_write_begin(t);
+			if (data_extend(t, bignum) != 0) {
+				seq_write_end(t);
+				fprintf(stderr, "failed allocation from %zu to %zu in jseek() past end\n", stream->memsz, (size_t)bignum);
+				return -1;//return error condition
 			}
+			seq_write_end(t);
+			jsync(stream, t);
 		}
+		stream->pos = bignum;
 		break;
 	case SEEK_SET:
 		if (offset < 0)
 			return -1;
-		if (offset > stream->sz)
+		if ((size_t)offset > stream->sz)
 			return -1;
 		stream->pos = offset;
 		break;
@@ -827,71 +5460,488 @@ int jseek(JILE* stream, long offset, int whence) {
 	return 0;
 }
 
+int jseek(JILE* stream, long offset, int whence) {
+	int r;
+	uint64_t t0 = stat_begin();
+	node* t = jlock(stream, 1);
+	if (!t) {//not an open stream
+		stat_end(JST_JSEEK, t0);
+		return -1;
+	}
+	r = jseek_locked(stream, t, offset, whence);
+	node_unlock(t);
+	stat_end(JST_JSEEK, t0);
+	return r;
+}
+
 
 long int jtell(JILE* stream) {
 	return (long int)(stream->pos);
 }
 
-int j_open(const char *path, int flags){
+static int open_do(const char *path, int flags){
 	JILE* grab;
 	ptrdiff_t pg;
+	node* t;
 	int fd=-1;
+	if (!path || !flags)return -1;
+	if (path[0] != '/') return -1;
+	/*--find or make the file--*/
+	t = path_lock(path, 1);
+	if (!t) {
+		char name[NAME_L];
+		if (!(flags & J_CREAT)) return -1;
+		extract_name(path, name);
+		if (name[0] == '\0') return -1;
+		//may lose a race with another creator, that is fine
+		create(name, (char*)path, calc_path_length((char*)path), FILE_T);
+		t = path_lock(path, 1);
+		if (!t) return -1;
+	}
+	if (t->type != FILE_T) {
+		node_unlock(t);
+		return -1;
+	}
+	jmx_lock(&jfdlock);
 	/*--ensure--*/
-	if (!jheadfree && !jfds[0].fileDataBuffer) {
+	if (!jfdsready) {
 		size_t i;
 		jheadfree = &jfds[0];
 		for (i = 0; i+1 < sizeof jfds / sizeof(JILE); ++i) {
 			jfds[i].priv = &jfds[i + 1];
 		}
+		jfds[i].priv = NULL;
+		jfdsready = 1;
 	}
-	if (!path || !flags)return -1;
 	/*--grab--*/
 	grab = jheadfree;
-	if (!grab) return -1;
+	if (!grab) {
+		jmx_unlock(&jfdlock);
+		node_unlock(t);
+		return -1;
+	}
 	jheadfree = (JILE*)grab->priv;
 	/*--get fd--*/
 	pg = grab - &jfds[0];
 	if (pg >= 0) {
-		pg /= sizeof(JILE);
 		fd = (int)pg;
 	}
 	else goto bad;
 
-
-    grab->allowedRead = flags & J_RDONLY;
-    grab->allowedWrite = flags & J_WRONLY;
-    
-    
-    /*ris = read_file(path, name, contenuto);
-    if(ret->allowedWrite != ret->allowed)
-        if (ris == OK) {
-            if (strlen(contenuto) == 0)
-                printf("contenuto \n");
-            else
-                printf("contenuto %s\n", contenuto); // lettura file riuscita
-        }
-        else {
-            //not existing
-            if(flags & J_CREAT) {
-                int path_length;
-                char buf[260+1];buf[0]='\0';
-                extract_name(path, buf);
-                path_length = calc_path_length(path);
-                ris = create(path, buf, path_length, FILE_T);
-                if(ris == OK) {
-                    JILE* ret = (JILE*)malloc(sizeof (JILE));
-                    return ret;
-                } else return NULL;
-            } else return NULL;
-        }
-    */
-    
-    return fd;
+	grab->allowedRead = flags & J_RDONLY;
+	grab->allowedWrite = flags & J_WRONLY;
+	if ((flags & J_TRUNC) && grab->allowedWrite) {
+		seq_write_begin(t);
+		data_trunc(t, 0);
+		seq_write_end(t);
+	}
+	grab->pos = 0;
+	grab->areWeAllowedToReallocIt = 1;
+	grab->priv = t;
+	grab->isOpen = 1;
+	jmx_unlock(&jfdlock);
+	t->opens++;
+	jsync(grab, t);
+	node_unlock(t);
+	return fd;
 bad:
 	grab->fileDataBuffer = NULL;
 	grab->priv = jheadfree;
 	jheadfree = grab;
+	jmx_unlock(&jfdlock);
+	node_unlock(t);
 	return -1;
 }
+int j_open(const char *path, int flags){
+	uint64_t t0 = stat_begin();
+	int fd = open_do(path, flags);
+	stat_end(JST_JOPEN, t0);
+	return fd;
+}
+
+int jclose(JILE* stream) {
+	int last;
+	node* t = jlock(stream, 1);
+	if (!t) return EOF;
+	t->opens--;
+	last = t->dead && t->opens == 0 && t->maps == 0 && jgetacq(t->pins) == 0;
+	node_unlock(t);
+	if (last)//deleted while open, this was the last hold
+		destroy_element(t);
+	jmx_lock(&jfdlock);
+	stream->isOpen = 0;
+	stream->fileDataBuffer = NULL;
+	stream->sz = stream->memsz = stream->pos = 0;
+	stream->priv = jheadfree;
+	jheadfree = stream;
+	jmx_unlock(&jfdlock);
+	return 0;
+}
+
+size_t jread(void* ptr, size_t size, size_t nmemb, JILE* stream) {
+	size_t want, have;
+	node* t = jlock(stream, 0);
+	if (!t) return 0;
+	if (!stream->allowedRead || !size || stream->pos >= stream->sz) {
+		node_unlock(t);
+		return 0;
+	}
+	want = size * nmemb;
+	have = stream->sz - stream->pos;
+	if (want > have) want = have;
+	data_get(t, stream->pos, ptr, want);
+	node_unlock(t);
+	stream->pos += want;
+	return want / size;
+}
+
+/**
+ writes the n bytes gathered from iov into t, held exclusive, at offset
+ at, growing the buffer once; a gap before at reads back as zero
+ @return 0 okay, -1 out of memory or mapped
+*/
+static int data_gather(node* t, size_t at, const struct jiovec* iov, int iovcnt, size_t n) {
+	size_t end = at + n;
+	int i;
+	if (n == 0)
+		return 0;
+	if (end < at)
+		return -1;
+	seq_write_begin(t);
+	//data_extend() zeroes a gap left by a seek past the end
+	if (data_reserve(t, end) != 0 || data_extend(t, at) != 0) {
+		seq_write_end(t);
+		return -1;
+	}
+	for (i = 0; i < iovcnt; i++) {
+		if (data_put(t, at, iov[i].iov_base, iov[i].iov_len) != 0)
+			break;
+		at += iov[i].iov_len;
+	}
+	if (at > t->datasz)
+		jset(t->datasz, at);
+	seq_write_end(t);
+	return i == iovcnt ? 0 : -1;
+}
+
+size_t jwrite(const void* ptr, size_t size, size_t nmemb, JILE* stream) {
+	struct jiovec v;
+	node* t = jlock(stream, 1);
+	if (!t) return 0;
+	v.iov_base = (void*)ptr;
+	v.iov_len = size * nmemb;
+	if (!stream->allowedWrite || !size
+		|| data_gather(t, stream->pos, &v, 1, v.iov_len) != 0) {
+		node_unlock(t);
+		return 0;
+	}
+	stream->pos += v.iov_len;
+	jsync(stream, t);
+	node_unlock(t);
+	return nmemb;
+}
+
+int j_close(int fd) {
+	return jclose(jdopen(fd, "r")) == 0 ? 0 : -1;
+}
+
+long j_read(int fd, void* buf, size_t count) {
+	JILE* j = jdopen(fd, "r");
+	if (!j || !j->allowedRead) return -1;
+	return (long)jread(buf, 1, count, j);
+}
+
+long j_write(int fd, const void* buf, size_t count) {
+	JILE* j = jdopen(fd, "w");
+	if (!j || !j->allowedWrite) return -1;
+	if (count && jwrite(buf, 1, count, j) != count) return -1;
+	return (long)count;
+}
+
+/*--
+ positional I/O locks the file alone and leaves the stream untouched,
+ neither its position nor its view of the buffer, so threads sharing
+ one descriptor do not get in each other's way
+--*/
+static node* jpos_lock(int fd, int excl, int write) {
+	JILE* j = jdopen(fd, "r");
+	node* t;
+	if (!j || !(write ? j->allowedWrite : j->allowedRead)) return NULL;
+	t = (node*)j->priv;
+	if (excl) jrw_wr(&t->lock); else jrw_rd(&t->lock);
+	return t;
+}
+
+long jpread(int fd, void* buf, size_t count, off_t offset) {
+	size_t have;
+	node* t;
+	if (offset < 0) return -1;
+	t = jpos_lock(fd, 0, 0);
+	if (!t) return -1;
+	have = (size_t)offset < t->datasz ? t->datasz - (size_t)offset : 0;
+	if (count > have) count = have;
+	data_get(t, (size_t)offset, buf, count);
+	node_unlock(t);
+	return (long)count;
+}
 
+long jpwrite(int fd, const void* buf, size_t count, off_t offset) {
+	struct jiovec v;
+	node* t;
+	int r;
+	if (offset < 0) return -1;
+	t = jpos_lock(fd, 1, 1);
+	if (!t) return -1;
+	v.iov_base = (void*)buf;
+	v.iov_len = count;
+	r = data_gather(t, (size_t)offset, &v, 1, count);
+	node_unlock(t);
+	return r == 0 ? (long)count : -1;
+}
+
+/**@return the bytes iov spans, (size_t)-1 if that does not fit*/
+static size_t iov_total(const struct jiovec* iov, int iovcnt) {
+	size_t n = 0;
+	int i;
+	if (!iov || iovcnt < 0) return (size_t)-1;
+	for (i = 0; i < iovcnt; i++) {
+		if (iov[i].iov_len > ((size_t)-1 >> 1) - n) return (size_t)-1;
+		n += iov[i].iov_len;
+	}
+	return n;
+}
+
+long jreadv(int fd, const struct jiovec* iov, int iovcnt) {
+	JILE* j = jdopen(fd, "r");
+	size_t have, n;
+	node* t;
+	int i;
+	if (!j || !j->allowedRead || iov_total(iov, iovcnt) == (size_t)-1) return -1;
+	t = jlock(j, 0);
+	if (!t) return -1;
+	have = j->pos < j->sz ? j->sz - j->pos : 0;
+	for (i = 0, n = 0; i < iovcnt && n < have; i++) {
+		size_t c = iov[i].iov_len < have - n ? iov[i].iov_len : have - n;
+		data_get(t, j->pos + n, iov[i].iov_base, c);
+		n += c;
+	}
+	node_unlock(t);
+	j->pos += n;
+	return (long)n;
+}
+
+long jwritev(int fd, const struct jiovec* iov, int iovcnt) {
+	JILE* j = jdopen(fd, "w");
+	size_t n = iov_total(iov, iovcnt);
+	node* t;
+	if (!j || !j->allowedWrite || n == (size_t)-1) return -1;
+	t = jlock(j, 1);
+	if (!t) return -1;
+	if (data_gather(t, j->pos, iov, iovcnt, n) != 0) {
+		node_unlock(t);
+		return -1;
+	}
+	j->pos += n;
+	jsync(j, t);
+	node_unlock(t);
+	return (long)n;
+}
+
+#ifndef MAX_JMAPS
+#define MAX_JMAPS 100
+#endif
+struct jmapping {
+	const void* addr;
+	node* file;
+};
+static struct jmapping jmaps[MAX_JMAPS];
+static jmutex jmaplock = JMUTEX_INIT;
+
+/**
+ makes the content of t, held exclusive, one run of bytes a view can
+ point into and see writes in: the mounted image's bytes as they are,
+ else a buffer of t's own, neither shared with clones nor in extents
+ @return 0 okay, -1 out of memory
+*/
+static int jmap_own(node* t) {
+	int r = 0;
+	if (t->datacap != 0 || (t->ext == NULL && t->share == NULL && t->data != NULL))
+		return 0;
+	seq_write_begin(t);
+	if (t->ext == NULL)
+		r = data_reserve(t, t->datasz ? t->datasz : 1);
+	if (r == 0 && t->ext != NULL)
+		r = ext_merge(t);
+	seq_write_end(t);
+	return r;
+}
+
+const void* jmap(const char* path, size_t* len) {
+	node* t;
+	size_t i;
+	const void* addr = NULL;
+	if (!path || path[0] != '/') return NULL;
+	t = path_lock(path, 1);
+	if (!t) return NULL;
+	if (t->type == FILE_T && jmap_own(t) == 0) {
+		jmx_lock(&jmaplock);
+		for (i = 0; i < MAX_JMAPS; ++i) {
+			if (jmaps[i].addr == NULL) {
+				jmaps[i].addr = t->data;
+				jmaps[i].file = t;
+				t->maps++;
+				if (len) *len = t->datasz;
+				addr = t->data;
+				break;
+			}
+		}
+		jmx_unlock(&jmaplock);
+	}
+	node_unlock(t);
+	return addr;
+}
+
+int junmap(const void* addr) {
+	size_t i;
+	int last;
+	node* t = NULL;
+	if (!addr) return -1;
+	jmx_lock(&jmaplock);
+	for (i = 0; i < MAX_JMAPS; ++i) {
+		if (jmaps[i].addr == addr) {
+			t = jmaps[i].file;
+			jmaps[i].addr = NULL;
+			jmaps[i].file = NULL;
+			break;
+		}
+	}
+	jmx_unlock(&jmaplock);
+	if (i == MAX_JMAPS) return -1;
+	jrw_wr(&t->lock);
+	t->maps--;
+	if (t->maps == 0 && t->ext == NULL && t->datacap != 0 && t->datasz > JFS_EXTENT) {
+		/*--merged for the views, back in extents now they are gone; kept whole if that fails--*/
+		seq_write_begin(t);
+		ext_reserve(t, t->datasz);
+		seq_write_end(t);
+	}
+	last = t->dead && t->opens == 0 && t->maps == 0 && jgetacq(t->pins) == 0;
+	node_unlock(t);
+	if (last)
+		destroy_element(t);
+	return 0;
+}
 
+/**
+ pays attention to J_CREAT and J_TRUNC only; the record's filedata is
+ a jmap() view of the file, held until jfallbackClose()
+*/
+struct jamrampath* jfallbackOpen(const char* path, int mode) {
+	struct jamrampath* rec;
+	const void* addr;
+	size_t len, l;
+	int fd;
+	if (!path)
+		return NULL;
+	if (mode & (J_CREAT | J_TRUNC)) {
+		fd = j_open(path, J_WRONLY | (mode & (J_CREAT | J_TRUNC)));
+		if (fd < 0)
+			return NULL;
+		j_close(fd);
+	}
+	addr = jmap(path, &len);
+	if (!addr)
+		return NULL;
+	l = strlen(path);
+	rec = (struct jamrampath*)arena_alloc(sizeof(struct jamrampath));
+	if (rec)
+		rec->path = (char*)arena_alloc(l + 1);
+	if (!rec || !rec->path) {
+		arena_free(rec, sizeof(struct jamrampath));
+		junmap(addr);
+		return NULL;
+	}
+	memcpy(rec->path, path, l + 1);
+	rec->filedata = (char*)addr;
+	rec->filesize = len;
+	rec->status = jamrampath_FILE_ALREADY_OPEN;
+	return rec;
+}
+void jfallbackClose(struct jamrampath* node) {
+	if (!node)
+		return;
+	junmap(node->filedata);
+	arena_free(node->path, strlen(node->path) + 1);
+	arena_free(node, sizeof(struct jamrampath));
+}
+
+//####################################################################################
+
+#ifndef JAMRAMFS_NO_STATS
+static const char* const statnames[JST_OPS] = {
+	"create", "read_file", "write_file", "delete", "delete_r",
+	"find", "jopen", "jseek", "jkdir", "jremove"
+};
+
+static void stat_add(struct jstats* s, struct jthread* t) {
+	int i, j;
+	for (i = 0; i < JST_OPS; i++) {
+		s->calls[i] += jget(t->st.calls[i]);
+		for (j = 0; j < JST_LAT; j++)
+			s->lat[i][j] += jget(t->st.lat[i][j]);
+	}
+	for (j = 0; j < JST_DEPTH; j++)
+		s->depth[j] += jget(t->st.depth[j]);
+	for (j = 0; j < JST_SCAN; j++)
+		s->scan[j] += jget(t->st.scan[j]);
+	s->nodes += jget(t->st.nodes);
+	s->bytes += jget(t->st.bytes);
+}
+
+/**" lower:count" for each bucket in use, bucket i starting at 2^(i-1)*/
+static void stat_hist(FILE* out, const unsigned long* h, int nb, int pow2) {
+	int i;
+	for (i = 0; i < nb; i++)
+		if (h[i] != 0)
+			fprintf(out, " %llu:%lu", pow2 && i != 0 ? 1ULL << (i - 1) : (unsigned long long)i, h[i]);
+	fputc('\n', out);
+}
+#endif
+
+void jfs_stats(FILE* out) {
+	unsigned long hits, misses;
+	int i, open = 0;
+#ifndef JAMRAMFS_NO_STATS
+	struct jstats s;
+	memset(&s, 0, sizeof s);
+#ifdef JAMRAMFS_THREADS
+	{
+		struct jthread* t;
+		jmx_lock(&jthreadslock);
+		for (t = jthreads; t != NULL; t = t->next)
+			stat_add(&s, t);
+		jmx_unlock(&jthreadslock);
+	}
+#else
+	stat_add(&s, &jthreadonly);
+#endif
+#endif
+	jmx_lock(&jfdlock);
+	for (i = 0; i < MAX_JFDS; i++)
+		if (jfds[i].isOpen)
+			open++;
+	jmx_unlock(&jfdlock);
+	jfs_path_cache_stats(&hits, &misses);
+	fprintf(out, "open %d\npath_cache %lu hits %lu misses\n", open, hits, misses);
+#ifndef JAMRAMFS_NO_STATS
+	fprintf(out, "nodes %ld\nbytes %ld\n", s.nodes, s.bytes);
+	for (i = 0; i < JST_OPS; i++) {
+		fprintf(out, "op %s %lu ns", statnames[i], s.calls[i]);
+		stat_hist(out, s.lat[i], JST_LAT, 1);
+	}
+	fputs("depth", out);
+	stat_hist(out, s.depth, JST_DEPTH, 0);
+	fputs("scan", out);
+	stat_hist(out, s.scan, JST_SCAN, 0);
+#endif
+}
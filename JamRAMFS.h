@@ -2,11 +2,13 @@
 #ifndef core_JamFS_h
 #define core_JamFS_h
 
+#include <stdio.h>//FILE
+
 enum returnCode { OK, NO };
 
 /**
  @param name
- this will be strcpy()'d
+ this will be strcpy()'d, 1 to 255 characters, none of them '/'
  */
 enum returnCode create(char * name, char * path, int path_length, char res_type);
 
@@ -16,6 +18,195 @@ enum returnCode delete(char *path, char *name);
 
 enum returnCode read_file(char * path, char * name, char * fileContent);
 
+/**
+ deletes path and everything below it. The subtree is cut off from its
+ parent in constant time, and so vanishes from lookups at once, then
+ torn down without recursion. Files still open or mapped stay usable
+ through their streams and views, and are freed at the last jclose()
+ or junmap(). For "/" the root itself stays.
+ @return the number of resources deleted, -1 if path does not exist
+ */
+long jfs_delete_r(const char * path);
+
+/**
+ jfs_delete_r() that does not wait for the teardown: path vanishes
+ before the call returns, the freeing is left to a background thread
+ (with JAMRAMFS_THREADS). Should too many deletes be waiting already,
+ or the thread not start, the caller frees the subtree itself.
+ @return 0 okay, -1 if path does not exist
+ */
+long jfs_delete_async(const char * path);
+/**
+ waits until every subtree handed over by jfs_delete_async() is freed
+ */
+void jfs_delete_async_wait(void);
+
+/**
+ copies src and everything below it to the new path dst, whose parent
+ must exist. Only the nodes are made anew: file contents are shared
+ with src and copied the first time either side writes them, so the
+ cost follows the number of resources, not their size.
+ @return the number of resources copied, -1 on error
+ */
+long jfs_clone(const char * src, const char * dst);
+
+/**
+ binary safe write_file(), replaces the whole content
+ @return bytes written, -1 on error
+ */
+long write_file_n(char * path, char * name, const void * fileContent, size_t len);
+
+/**
+ binary safe read_file()
+ @param bufsz
+ at most this many bytes are copied into fileContent, no terminator is added
+ @return the full size of the file (may exceed bufsz), -1 on error
+ */
+long read_file_n(char * path, char * name, void * fileContent, size_t bufsz);
+
+/**
+ counters of the full path lookup cache behind read_file() and write_file()
+ @param hits
+ may be NULL
+ @param misses
+ may be NULL
+ */
+void jfs_path_cache_stats(unsigned long * hits, unsigned long * misses);
+
+/**
+ writes what the filesystem has counted so far to out, one item per line:
+ open descriptors, the path cache, resident nodes and content bytes, and
+ for create(), read_file(), write_file(), delete(), jfs_delete_r(),
+ jfs_find(), j_open() (and so jopen()), jseek(), jkdir() and jremove()
+ "op name calls ns" followed by the latency histogram as " from:count"
+ pairs, bucket by bucket in powers of two. Last come the histograms of
+ components walked per lookup ("depth") and of kids table slots probed
+ per component ("scan"), for lookups the path cache did not answer.
+ Every thread counts in its own record and this sums them, so counting
+ costs no contention; build with JAMRAMFS_NO_STATS to leave all of it
+ out, the first two lines aside.
+ */
+void jfs_stats(FILE * out);
+
+/**
+ called by jfs_find() once per match
+ @param path
+ the match's full path, only good until the call returns
+ @return 0 to go on, anything else stops the search
+ */
+typedef int (*jfs_find_cb)(const char * path, void * arg);
+/**
+ streams every resource named name at or below path to cb, without
+ holding on to the matches. An exact name is one probe of a basename
+ index; name may also be a pattern with '*' and '?', which checks each
+ distinct name once (or, below the root, walks just that subtree).
+ cb is called with locks held, so what would change the tree from
+ inside it (create(), write_file_n(), delete(), jremove() and the like)
+ fails straight away rather than waiting on the find.
+ @param sorted
+ non zero to have the matches handed over in strcmp() order instead,
+ which keeps them all until one final sort; cb then runs with nothing
+ held and may change the tree
+ @return the number of matches handed to cb, -1 on error
+ */
+long jfs_find(const char * path, const char * name, int sorted, jfs_find_cb cb, void * arg);
+
+/**
+ test for jfs_find_par(), called from several threads at once
+ @param isdir
+ non zero for a directory, which has no data
+ @param data
+ the file's content, only good until the call returns
+ @return non zero for a match
+ */
+typedef int (*jfs_match_fn)(const char * path, const char * name, int isdir,
+                            const void * data, size_t size, void * arg);
+/**
+ exhaustive find for tests no index can answer (content, patterns over
+ a huge tree): the directories at or below path are shared out among
+ worker threads. Matches are handed to cb afterwards, in strcmp() order,
+ from the calling thread, so the output does not depend on the workers.
+ match runs with locks held, and changes made from it fail as they do
+ from a jfs_find() callback.
+ @param nthreads
+ workers to use, the caller included; 0 for one per processor
+ @return the number of matches handed to cb, -1 on error
+ */
+long jfs_find_par(const char * path, jfs_match_fn match, void * marg,
+                  jfs_find_cb cb, void * arg, int nthreads);
+/**
+ deletes path and everything below it, shared out among worker threads
+ like jfs_find_par(). Files still open or mapped, and the directories
+ above them, are kept. For "/" the root itself stays.
+ @return the number of resources deleted, -1 if path does not exist
+ */
+long jfs_delete_par(const char * path, int nthreads);
+
+/**
+ writes the whole filesystem to an image file,
+ through path.tmp so an earlier image is only replaced by a complete one.
+ Writers elsewhere in the tree are not held up for the whole save, so
+ under concurrent writes the image is consistent directory by directory.
+ Each directory's sons are stored sorted by name, which is the order
+ jfs_load() gives them back in.
+ @return 0 okay, -1 on error or while an image is mounted
+ */
+int jfs_save(const char * path);
+/**
+ fills an empty filesystem from an image written by jfs_save(): one
+ read of the file, then every resource built from it with no parsing.
+ Images from another version or byte order are refused.
+ @return 0 okay, -1 if the image is bad or the filesystem is not empty,
+ which is then left as it was
+ */
+int jfs_load(const char * path);
+/**
+ puts an image written by jfs_save() under an empty filesystem, for
+ good: lookups, read_file() and jread() are served from the image as
+ it is, and whatever is written or deleted goes to the tree above it,
+ copying up just the resources touched. Built with JAMRAMFS_MMAP the
+ image is mapped, so processes mounting the same file share its pages;
+ otherwise it is read in whole. jfs_find(), jfs_find_par() and
+ jfs_delete_r()'s count see only resources copied up or created.
+ @return 0 okay, -1 if the image is bad or the filesystem is not empty
+ */
+int jfs_mount(const char * path);
+
+/**
+ makes changes durable (build with JAMRAMFS_JOURNAL): every create(),
+ write_file(), delete(), jfs_delete_r(), jfs_delete_async(),
+ jfs_delete_par(), jfs_clone(), jkdir() and jremove() that succeeds is
+ logged to path and only returns once the log is on disk, with one
+ fsync() for all the threads waiting at the time. Reads pay nothing.
+ The empty filesystem is first filled from the snapshot path.snap, if
+ there is one, and then from the changes in the log, up to the last
+ whole record. Writes through streams (jwrite(), J_TRUNC) are not
+ logged, and no image may be mounted or loaded alongside. A change
+ that cannot be logged (write or fsync() failing, out of memory) fails,
+ returning NO or -1 though it may already show in memory, and so does
+ every change after it, until jfs_journal_close().
+ @return 0 okay, -1 if the filesystem is not empty, or on error,
+ which leaves it empty
+ */
+int jfs_journal_open(const char * path);
+/**
+ folds the log into a new path.snap and starts it empty again, as
+ happens by itself once it has grown past JFS_JOURNAL_COMPACT bytes;
+ changes wait meanwhile. The new snapshot is read back and checked
+ before it replaces the old one, which stays with its log otherwise
+ @return 0 okay, -1 on error or with no journal open
+ */
+int jfs_journal_compact(void);
+/**
+ @return 0 okay, -1 if some change could not be logged since
+ jfs_journal_open(), or with no journal open
+ */
+int jfs_journal_close(void);
+
+/**
+ with JAMRAMFS_THREADS every call may come from any thread,
+ but one JILE stream should only be used by one thread at a time
+ */
 struct jiletag {
     int allowedRead;
     int allowedWrite;
@@ -25,6 +216,7 @@ struct jiletag {
     size_t memsz;
     int areWeAllowedToReallocIt;
     void* priv;
+    int isOpen;
 };
 typedef struct jiletag JILE;
 /**
@@ -46,13 +238,38 @@ int j_open(const char *path, int flags);
 /**
  sets the file position
  @param whence
- it should be SEEK_SET, SEEK_CUR, or SEEK_END
+ it should be SEEK_SET, SEEK_CUR, or SEEK_END; SEEK_END past the end
+ grows the file with zeroes, and fails on a stream opened read only
  @return it returns negative on error
  @retval 0 okay
  @retval -1 error
 */
 int jseek(JILE* stream, long offset, int whence);
 
+/**
+ reads up to size*nmemb bytes at the stream position, like fread()
+ @return the number of whole items read
+ */
+size_t jread(void *ptr, size_t size, size_t nmemb, JILE *stream);
+/**
+ writes size*nmemb bytes at the stream position, like fwrite(),
+ growing the file as needed; a gap left by seeking past the end reads as zero
+ @return the number of items written, 0 on error
+ */
+size_t jwrite(const void *ptr, size_t size, size_t nmemb, JILE *stream);
+/**
+ @retval 0 okay
+ @retval EOF not an open stream
+ */
+int jclose(JILE *stream);
+/**
+ descriptor variants of jread() jwrite() jclose(), like read() write() close()
+ @return bytes transferred, -1 on error
+ */
+long j_read(int fd, void *buf, size_t count);
+long j_write(int fd, const void *buf, size_t count);
+int j_close(int fd);
+
 #define J_RDONLY (1<<1)
 #define J_WRONLY (1<<2)
 #define J_RDWR   (J_RDONLY|J_WRONLY)
@@ -75,6 +292,28 @@ give FILE*, get file descriptor, but jamos variant
 */
 int jileno(const JILE* stream);
 
+/**
+ read only view straight into a file's buffer, no copy is made.
+ While mapped the file cannot be deleted and writes that would need
+ the buffer to move fail; writes within it are seen through the view.
+ A file still as it is in a mounted image is viewed in the image
+ itself, and cannot be written until the last junmap().
+ A file kept in extents (past JFS_EXTENT bytes, 64KB) is put back in
+ one buffer by its first jmap(), and in extents again by the last
+ junmap(). A file sharing its content with clones gets a copy of its
+ own when mapped, and a mapped file is cloned by copying, so both
+ sides of a clone stay writable.
+ @param len
+ receives the file size at the time of mapping
+ @return NULL on error, else the view, to be given back to junmap()
+ */
+const void *jmap(const char *path, size_t *len);
+/**
+ @retval 0 okay
+ @retval -1 not a view from jmap()
+ */
+int junmap(const void *addr);
+
 /**
 blkcnt_t and off_t shall be signed integer types.
 */
@@ -88,9 +327,53 @@ typedef long long off_t;
 #endif 
 off_t jlseek(int fd, off_t offset, int whence);
 
+/**
+ like pread() pwrite(): at offset, with the descriptor's position left
+ as it is, so several threads may use one descriptor at once. Writing
+ past the end grows the file, the gap reading back as zero.
+ @return bytes transferred, 0 at or past the end for jpread(), -1 on error
+ */
+long jpread(int fd, void *buf, size_t count, off_t offset);
+long jpwrite(int fd, const void *buf, size_t count, off_t offset);
+
+/**
+ a file past JFS_EXTENT bytes (64KB) is sparse: a range never written,
+ such as the gap a seek past the end leaves, is a hole that takes no
+ memory and reads as zero. jfs_fallocate() backs offset..offset+len of
+ the file at path with memory, so writes there cannot run out of it,
+ growing the file if it is shorter; jfs_punch_hole() turns the range
+ back into a hole, zeros throughout, and keeps the size. Neither is
+ logged by jfs_journal_open(), like writes through streams. A file
+ cut into extents, as it grows past JFS_EXTENT or is loaded that big,
+ has its all zero pieces left holes, so holes survive jfs_save() and
+ jfs_load(); in a smaller file a punch just writes zeros.
+ @return 0 okay, -1 on error
+ */
+int jfs_fallocate(const char *path, off_t offset, off_t len);
+int jfs_punch_hole(const char *path, off_t offset, off_t len);
+
+struct jiovec {
+    void *iov_base;
+    size_t iov_len;
+};
+/**
+ like readv() writev(): one call for iovcnt buffers at the descriptor's
+ position, which moves past them. jwritev() grows the file once and
+ writes all the pieces under one lock, so a header and its payload
+ land together.
+ @return bytes transferred, -1 on error
+ */
+long jreadv(int fd, const struct jiovec *iov, int iovcnt);
+long jwritev(int fd, const struct jiovec *iov, int iovcnt);
+
 /**
 just as a fallback so this can be used without
-VirtDir dependancy
+VirtDir dependancy; these work on the same tree as
+create() and jopen(). jkdir() makes any missing
+directories above path too, jremove() takes a
+directory with everything below it, save files
+still open or mapped and the directories above
+them, which stay
 @return negative on failure
 @retval 0
 okay
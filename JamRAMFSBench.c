@@ -0,0 +1,262 @@
+/**
+@file JamRAMFSBench.c
+@brief benchmarks for JamRAMFS, one JSON object per line on stdout
+
+ Build it with the same flags as the filesystem itself, e.g.
+
+   cc -O2 -std=c11 JamRAMFSBench.c JamRAMFS.c -o jamramfs_bench
+   cc -O2 -std=c11 -DJAMRAMFS_THREADS -pthread ... (the threaded build)
+
+ Options, all optional:
+   -w width   directories per directory (8)
+   -d depth   directory levels below the root (4)
+   -f files   files in each directory of the last level (8)
+   -n count   lookups and churn operations (200000)
+   -s MiB     bytes streamed through jwrite() and jread() (64)
+   -r seed    for the random paths (1)
+
+ Every line has "bench" and "ops"; latencies are in ns, rates per second.
+ Compare runs by field, the order of the lines is not part of the output.
+*/
+#define _CRT_SECURE_NO_WARNINGS
+#define _POSIX_C_SOURCE 200809L		// clock_gettime()
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "JamRAMFS.h"
+
+struct res * path_travel(char * path);	// not in the header, JamRAMFS.c's own lookup
+
+static int width = 8, depth = 4, files = 8;
+static long count = 200000;
+static long streammb = 64;
+static unsigned long seed = 1;
+
+//####################################################################################
+
+/**@return a monotonic time in ns, which no clock adjustment moves*/
+static uint64_t now_ns(void) {
+	struct timespec ts;
+#ifdef CLOCK_MONOTONIC
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+#else
+	timespec_get(&ts, TIME_UTC);
+#endif
+	return (uint64_t) ts.tv_sec * 1000000000u + (uint64_t) ts.tv_nsec;
+}
+
+/**xorshift, so runs with the same seed walk the same paths*/
+static unsigned long rnd(void) {
+	seed ^= seed << 13;
+	seed ^= seed >> 7;
+	seed ^= seed << 17;
+	return seed;
+}
+
+static int u64_cmp(const void * a, const void * b) {
+	uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+	return x < y ? -1 : x > y;
+}
+
+/**one line for a timed batch of n operations*/
+static void report_rate(const char * bench, long n, uint64_t ns) {
+	printf("{\"bench\":\"%s\",\"ops\":%ld,\"total_ns\":%" PRIu64 ",\"ops_per_s\":%.0f}\n",
+	       bench, n, ns, ns > 0 ? n * 1e9 / (double) ns : 0.0);
+}
+
+/**one line for n single timings, sorted here*/
+static void report_lat(const char * bench, uint64_t * t, long n) {
+	qsort(t, (size_t) n, sizeof(uint64_t), u64_cmp);
+	printf("{\"bench\":\"%s\",\"ops\":%ld,\"p50_ns\":%" PRIu64 ",\"p90_ns\":%" PRIu64 ",\"p99_ns\":%" PRIu64
+	       ",\"p999_ns\":%" PRIu64 ",\"max_ns\":%" PRIu64 "}\n",
+	       bench, n, t[n / 2], t[n * 9 / 10], t[n * 99 / 100], t[n * 999 / 1000], t[n - 1]);
+}
+
+//####################################################################################
+
+/**a random path of the generated tree: depth directories, and a file if leaf*/
+static void random_path(char * p, int leaf) {
+	int i;
+	p += sprintf(p, "/bench");
+	for (i = 0; i < depth; i++)
+		p += sprintf(p, "/d%lu", rnd() % (unsigned long) width);
+	if (leaf)
+		sprintf(p, "/f%lu", rnd() % (unsigned long) files);
+}
+
+/**fills the directory at path, which has level levels below it still*/
+static long build(char * path, int level) {
+	size_t l = strlen(path);
+	char name[32];
+	long n = 0;
+	int i;
+	int k = level == 0 ? files : width;
+	for (i = 0; i < k; i++) {
+		sprintf(name, level == 0 ? "f%d" : "d%d", i);
+		sprintf(path + l, "/%s", name);
+		if (create(name, path, depth + 2 - level, level == 0 ? 'F' : 'D') == OK) {
+			n++;
+			if (level == 0)
+				write_file(path, name, name);
+			else
+				n += build(path, level - 1);
+		}
+	}
+	path[l] = '\0';
+	return n;
+}
+
+static int count_match(const char * path, void * arg) {
+	(void) path;
+	(*(long *) arg)++;
+	return 0;
+}
+
+//####################################################################################
+
+static void bench_tree(void) {
+	char path[4096];
+	uint64_t t0 = now_ns();
+	long n;
+	strcpy(path, "/bench");
+	create("bench", path, 1, 'D');
+	n = build(path, depth);
+	report_rate("tree_build", n, now_ns() - t0);
+}
+
+static void bench_lookup(void) {
+	uint64_t * t = (uint64_t *) malloc(sizeof(uint64_t) * (size_t) count);
+	char path[4096];
+	long i, miss = 0;
+	if (t == NULL)
+		return;
+	for (i = 0; i < count; i++) {
+		uint64_t t0;
+		random_path(path, i & 1);
+		t0 = now_ns();
+		if (path_travel(path) == NULL)
+			miss++;
+		t[i] = now_ns() - t0;
+	}
+	report_lat("path_travel", t, count);
+	for (i = 0; i < count; i++) {
+		char buf[64];
+		uint64_t t0;
+		random_path(path, 1);
+		t0 = now_ns();
+		if (read_file(path, strrchr(path, '/') + 1, buf) != OK)
+			miss++;
+		t[i] = now_ns() - t0;
+	}
+	report_lat("read_file", t, count);
+	if (miss)
+		fprintf(stderr, "%ld lookups missed\n", miss);
+	free(t);
+}
+
+/**create() and delete() of files that come and go in one directory*/
+static void bench_churn(void) {
+	char path[64], name[32];
+	long i, ops = 0, live = 512;	// files kept alive in the directory
+	uint64_t t0;
+	create("churn", "/churn", 1, 'D');
+	t0 = now_ns();
+	for (i = 0; i < count; i++) {
+		sprintf(name, "c%ld", i % live);
+		sprintf(path, "/churn/%s", name);
+		if (i >= live && delete(path, name) == OK)
+			ops++;
+		if (create(name, path, 2, 'F') == OK)
+			ops++;
+	}
+	report_rate("create_delete_churn", ops, now_ns() - t0);
+	jfs_delete_r("/churn");
+}
+
+static void bench_bulk(void) {
+	char path[4096];
+	long i, n = 0;
+	uint64_t t0 = now_ns();
+	for (i = 0; i < count; i++) {
+		unsigned long a = rnd() % 1000, b = rnd() % 1000;
+		sprintf(path, "/bulk/k%lu/k%lu", a, b);
+		if (jkdir(path, 0) == 0)
+			n++;
+	}
+	report_rate("jkdir_bulk", n, now_ns() - t0);
+	t0 = now_ns();
+	jremove("/bulk");
+	report_rate("jremove_bulk", n, now_ns() - t0);
+}
+
+static void bench_find(void) {
+	long hits = 0, r;
+	uint64_t t0 = now_ns();
+	r = jfs_find("/", "f1", 0, count_match, &hits);
+	report_rate("jfs_find_exact", r, now_ns() - t0);
+	hits = 0;
+	t0 = now_ns();
+	r = jfs_find("/bench", "d1*", 0, count_match, &hits);
+	report_rate("jfs_find_pattern", r, now_ns() - t0);
+	hits = 0;
+	t0 = now_ns();
+	r = jfs_find("/", "f1", 1, count_match, &hits);
+	report_rate("jfs_find_sorted", r, now_ns() - t0);
+}
+
+/**jwrite() then jread() of streammb MiB in 64 KiB pieces*/
+static void bench_stream(void) {
+	static char buf[64 * 1024];
+	long i, chunks = streammb * 16;
+	uint64_t t0;
+	JILE * f = jopen("/stream", "w+");
+	if (f == NULL)
+		return;
+	memset(buf, 'x', sizeof(buf));
+	t0 = now_ns();
+	for (i = 0; i < chunks; i++)
+		jwrite(buf, 1, sizeof(buf), f);
+	printf("{\"bench\":\"jwrite\",\"ops\":%ld,\"bytes\":%ld,\"mib_per_s\":%.1f}\n",
+	       chunks, chunks * (long) sizeof(buf), streammb * 1e9 / (double) (now_ns() - t0));
+	jseek(f, 0, SEEK_SET);
+	t0 = now_ns();
+	for (i = 0; i < chunks; i++)
+		jread(buf, 1, sizeof(buf), f);
+	printf("{\"bench\":\"jread\",\"ops\":%ld,\"bytes\":%ld,\"mib_per_s\":%.1f}\n",
+	       chunks, chunks * (long) sizeof(buf), streammb * 1e9 / (double) (now_ns() - t0));
+	jclose(f);
+	jremove("/stream");
+}
+
+//####################################################################################
+
+int main(int argc, char * argv[]) {
+	int i;
+	for (i = 1; i + 1 < argc; i += 2) {
+		long v = atol(argv[i + 1]);
+		if (strcmp(argv[i], "-w") == 0) width = (int) v;
+		else if (strcmp(argv[i], "-d") == 0) depth = (int) v;
+		else if (strcmp(argv[i], "-f") == 0) files = (int) v;
+		else if (strcmp(argv[i], "-n") == 0) count = v;
+		else if (strcmp(argv[i], "-s") == 0) streammb = v;
+		else if (strcmp(argv[i], "-r") == 0) seed = (unsigned long) v;
+		else break;
+	}
+	if (i < argc || width < 1 || width > 1024 || files < 1 || files > 1024
+	|| depth < 0 || depth > 200 || count < 1 || streammb < 0 || seed == 0) {
+		fprintf(stderr, "usage: %s [-w width] [-d depth] [-f files] [-n count] [-s MiB] [-r seed]\n", argv[0]);
+		return 2;
+	}
+	printf("{\"bench\":\"config\",\"ops\":0,\"width\":%d,\"depth\":%d,\"files\":%d,\"count\":%ld,\"stream_mib\":%ld}\n",
+	       width, depth, files, count, streammb);
+	bench_tree();
+	bench_lookup();
+	bench_churn();
+	bench_bulk();
+	bench_find();
+	bench_stream();
+	return 0;
+}
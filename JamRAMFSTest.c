@@ -0,0 +1,452 @@
+/**
+@file JamRAMFSTest.c
+@brief self checking tests for JamRAMFS, exits non zero on a failure
+
+ Build it like JamRAMFSBench.c, with the same flags as the filesystem:
+
+   cc -O2 -std=c11 JamRAMFSTest.c JamRAMFS.c -o jamramfs_test
+   cc -O2 -std=c11 -DJAMRAMFS_THREADS -DJAMRAMFS_JOURNAL -pthread ... (everything)
+
+ The journal's checks need -DJAMRAMFS_JOURNAL, and the mounted image's
+ are the last, since an image stays mounted for good.
+
+ Images and logs are written to the current directory as jamramfs_test.*
+ and removed afterwards. Each test starts and ends with an empty tree.
+*/
+#define _CRT_SECURE_NO_WARNINGS
+#ifdef JAMRAMFS_JOURNAL
+#define _POSIX_C_SOURCE 200809L		// setrlimit(), to make the log's writes fail
+#include <signal.h>
+#include <sys/resource.h>
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "JamRAMFS.h"
+
+static int failures;
+
+#define CHECK(c) do { if (!(c)) { failures++; \
+	fprintf(stderr, "%s:%d: %s failed\n", __FILE__, __LINE__, #c); } } while (0)
+
+#define IMG "jamramfs_test.img"
+
+/**@return non zero if file path holds exactly the len bytes at want*/
+static int holds(const char * path, const void * want, long len) {
+	static char buf[1 << 20];
+	const char * name = strrchr(path, '/') + 1;
+	return read_file_n((char *) path, (char *) name, buf, sizeof(buf)) == len
+	    && memcmp(buf, want, (size_t) len) == 0;
+}
+
+/**@return what jpwrite() gives back for len bytes at offset into path*/
+static long pwrite_at(const char * path, const void * buf, size_t len, long offset) {
+	int fd = j_open(path, J_WRONLY);
+	long r = fd < 0 ? -1 : jpwrite(fd, buf, len, offset);
+	if (fd >= 0)
+		j_close(fd);
+	return r;
+}
+
+#define EXTENT 65536		// JFS_EXTENT as built
+
+/**@return the bytes of content jfs_stats() counts, -1 without stats*/
+static long content_bytes(void) {
+	char line[256];
+	long n = -1;
+	FILE * f = tmpfile();
+	if (f == NULL)
+		return -1;
+	jfs_stats(f);
+	rewind(f);
+	while (fgets(line, sizeof(line), f) != NULL)
+		if (sscanf(line, "bytes %ld", &n) == 1)
+			break;
+	fclose(f);
+	return n;
+}
+
+//####################################################################################
+
+/**names of 1 to 255 characters with no '/' go in, others are refused, and what goes in comes back*/
+static void test_image(void) {
+	char name[302], path[304];
+	memset(name, 'n', 300);
+	name[300] = '\0';
+	sprintf(path, "/%s", name);
+	CHECK(create(name, path, 1, 'F') == NO);
+	CHECK(create("", "/", 1, 'F') == NO);
+	CHECK(create("a/b", "/a/b", 1, 'F') == NO);
+	CHECK(create("a/b", "/x", 1, 'D') == NO);
+	name[255] = '\0';
+	path[256] = '\0';
+	CHECK(create(name, path, 1, 'F') == OK);
+	CHECK(write_file(path, name, "long") == 4);
+	CHECK(create("d", "/d", 1, 'D') == OK);
+	CHECK(create("f", "/d/f", 2, 'F') == OK);
+	CHECK(write_file_n("/d/f", "f", "a\0b", 3) == 3);
+	CHECK(jfs_save(IMG) == 0);
+	CHECK(jfs_delete_r("/") == 3);
+	CHECK(jfs_load(IMG) == 0);
+	CHECK(holds(path, "long", 4));
+	CHECK(holds("/d/f", "a\0b", 3));
+	jfs_delete_r("/");
+	remove(IMG);
+}
+
+/**create() makes name under the first path_length - 1 components, whatever path ends in*/
+static void test_create(void) {
+	char buf[8];
+	CHECK(create("foo", "/bar", 1, 'F') == OK);
+	CHECK(write_file_n("/foo", "foo", "x", 1) == 1);
+	CHECK(read_file_n("/bar", "foo", buf, sizeof(buf)) == -1);
+	CHECK(holds("/foo", "x", 1));
+	CHECK(create("bar", "/bar", 1, 'F') == OK);
+	CHECK(holds("/bar", "", 0));
+	jfs_delete_r("/");
+}
+
+/**a view of a file past JFS_EXTENT, which loads in extents, is one run of bytes that sees writes*/
+static void test_image_big(void) {
+	static char big[200001];
+	const char * v;
+	long i;
+	for (i = 0; i < 200000; i++)
+		big[i] = (char) (i * 7);
+	CHECK(create("big", "/big", 1, 'F') == OK);
+	CHECK(write_file_n("/big", "big", big, 200000) == 200000);
+	CHECK(jfs_save(IMG) == 0);
+	CHECK(jfs_delete_r("/") == 1);
+	CHECK(jfs_load(IMG) == 0);
+	CHECK(holds("/big", big, 200000));
+	v = (const char *) jmap("/big", NULL);
+	CHECK(v != NULL && memcmp(v, big, 200000) == 0);
+	CHECK(jmap("/big", NULL) == v);
+	CHECK(v == NULL || junmap(v) == 0);
+	CHECK(pwrite_at("/big", "-", 1, 150000) == 1);
+	CHECK(v != NULL && v[150000] == '-');
+	CHECK(pwrite_at("/big", "+", 1, 200000) == -1);		// the view's bytes cannot move
+	CHECK(jfs_clone("/big", "/copy") == 1);
+	CHECK(v == NULL || junmap(v) == 0);
+	CHECK(pwrite_at("/big", "+", 1, 200000) == 1);
+	big[150000] = '-';
+	big[200000] = '+';
+	CHECK(holds("/big", big, 200001));
+	CHECK(holds("/copy", big, 200000));
+	jfs_delete_r("/");
+	remove(IMG);
+}
+
+/**a stream only writes, or grows the file, if it was opened to write*/
+static void test_streams(void) {
+	char buf[16];
+	JILE * r;
+	JILE * w;
+	int fd;
+	CHECK(create("f", "/f", 1, 'F') == OK);
+	CHECK(write_file_n("/f", "f", "abc", 3) == 3);
+	r = jopen("/f", "r");
+	CHECK(r != NULL);
+	CHECK(jwrite("x", 1, 1, r) == 0);
+	CHECK(jseek(r, 10, SEEK_END) == -1);
+	CHECK(jseek(r, 10, SEEK_SET) == -1);
+	CHECK(jseek(r, -1, SEEK_END) == 0 && jread(buf, 1, sizeof(buf), r) == 1 && buf[0] == 'c');
+	CHECK(holds("/f", "abc", 3));
+	w = jopen("/f", "r+");
+	CHECK(w != NULL);
+	CHECK(jseek(w, 2, SEEK_END) == 0 && jwrite("d", 1, 1, w) == 1);
+	CHECK(holds("/f", "abc\0\0d", 6));
+	CHECK(jclose(w) == 0);
+	CHECK(jclose(r) == 0);
+	CHECK(jseek(r, 100, SEEK_END) == -1);		// closed
+	CHECK(jseek(r, 0, SEEK_SET) == -1);
+	fd = j_open("/f", J_RDONLY);
+	CHECK(fd >= 0);
+	CHECK(j_write(fd, "x", 1) == -1);
+	CHECK(jpwrite(fd, "x", 1, 0) == -1);
+	CHECK(jpread(fd, buf, sizeof(buf), 3) == 3 && memcmp(buf, "\0\0d", 3) == 0);
+	CHECK(j_close(fd) == 0);
+	fd = j_open("/f", J_WRONLY);
+	CHECK(fd >= 0);
+	CHECK(j_read(fd, buf, 1) == -1);
+	CHECK(jpwrite(fd, "e", 1, 6) == 1);
+	CHECK(j_close(fd) == 0);
+	CHECK(holds("/f", "abc\0\0de", 7));
+	CHECK(jkdir("/d/e", 0) == 0 && jkdir("/d/x/y", 0) == 0);
+	CHECK(create("g", "/d/e/g", 3, 'F') == OK && create("h", "/d/e/h", 3, 'F') == OK);
+	r = jopen("/d/e/g", "r+");
+	CHECK(r != NULL);
+	CHECK(jremove("/d") == 0);		// an open file stays, with the directories above it
+	CHECK(create("z", "/d/x/z", 3, 'F') != OK && create("h", "/d/e/h", 3, 'F') == OK);
+	CHECK(jwrite("g", 1, 1, r) == 1 && jclose(r) == 0 && holds("/d/e/g", "g", 1));
+	CHECK(jremove("/d") == 0 && jremove("/d") == -1);
+	jfs_delete_r("/");
+}
+
+/**clones share content until either side writes, even while mapped*/
+static void test_clone(void) {
+	static char big[200000];
+	char c = 0;
+	const char * v;
+	int fd;
+	CHECK(create("a", "/a", 1, 'F') == OK);
+	CHECK(write_file_n("/a", "a", "hello", 5) == 5);
+	v = (const char *) jmap("/a", NULL);
+	CHECK(v != NULL);
+	CHECK(jfs_clone("/a", "/b") == 1);
+	CHECK(pwrite_at("/a", "J", 1, 0) == 1);
+	CHECK(v != NULL && v[0] == 'J');
+	CHECK(holds("/b", "hello", 5));
+	CHECK(write_file_n("/b", "b", "world", 5) == 5);
+	CHECK(holds("/a", "Jello", 5));
+	CHECK(junmap(v) == 0);
+	CHECK(jfs_clone("/a", "/c") == 1);
+	v = (const char *) jmap("/c", NULL);
+	CHECK(v != NULL);
+	CHECK(pwrite_at("/c", "C", 1, 0) == 1);
+	CHECK(v != NULL && v[0] == 'C');
+	CHECK(holds("/a", "Jello", 5));
+	CHECK(junmap(v) == 0);
+	memset(big, 'z', sizeof(big));
+	CHECK(create("big", "/big", 1, 'F') == OK);
+	CHECK(write_file_n("/big", "big", big, sizeof(big)) == (long) sizeof(big));
+	CHECK(jfs_clone("/big", "/big2") == 1);
+	CHECK(pwrite_at("/big2", "x", 1, 100000) == 1);
+	fd = j_open("/big", J_RDONLY);
+	CHECK(fd >= 0 && jpread(fd, &c, 1, 100000) == 1 && c == 'z');
+	CHECK(fd < 0 || j_close(fd) == 0);
+	CHECK(holds("/big", big, sizeof(big)));
+	big[100000] = 'x';
+	CHECK(holds("/big2", big, sizeof(big)));
+	jfs_delete_r("/");
+}
+
+static int count_cb(const char * path, void * arg) {
+	(void) path;
+	(*(long *) arg)++;
+	return 0;
+}
+
+static int match_none(const char * path, const char * name, int isdir,
+                      const void * data, size_t size, void * arg) {
+	(void) path; (void) name; (void) isdir; (void) data; (void) size; (void) arg;
+	return 0;
+}
+
+/**counts the changes it gets to make*/
+static int change_cb(const char * path, void * arg) {
+	(void) path;
+	*(long *) arg += create("n", "/d/n", 2, 'F') == OK;
+	*(long *) arg += delete("/d/a", "a") == OK;
+	return 0;
+}
+
+/**sorted finds with no match, or one, hand over just that*/
+static void test_find(void) {
+	long n = 0;
+	CHECK(create("d", "/d", 1, 'D') == OK);
+	CHECK(create("a", "/d/a", 2, 'F') == OK);
+	CHECK(jfs_find("/", "x", 1, count_cb, &n) == 0 && n == 0);
+	CHECK(jfs_find("/", "a", 1, count_cb, &n) == 1 && n == 1);
+	CHECK(jfs_find_par("/", match_none, NULL, count_cb, &n, 2) == 0 && n == 1);
+	n = 0;		// a streamed match cannot change the tree, a sorted one can
+	CHECK(jfs_find("/", "a", 0, change_cb, &n) == 1 && n == 0);
+	CHECK(jfs_find("/d", "*", 0, change_cb, &n) == 2 && n == 0);
+	CHECK(jfs_find("/", "a", 1, change_cb, &n) == 1 && n == 2);
+	jfs_delete_r("/");
+}
+
+/**holes take no memory, read as zero, and come back from an image as holes*/
+static void test_sparse(void) {
+	static char want[4 * EXTENT];
+	long before = content_bytes(), after;
+	CHECK(create("s", "/s", 1, 'F') == OK);
+	CHECK(jfs_fallocate("/s", 0, 4 * EXTENT) == 0);
+	CHECK(holds("/s", want, 4 * EXTENT));
+	after = content_bytes();
+	CHECK(before < 0 || after - before >= 4 * EXTENT);
+	CHECK(jfs_punch_hole("/s", EXTENT, 2 * EXTENT) == 0);
+	CHECK(pwrite_at("/s", "a", 1, 3 * EXTENT + 5) == 1);
+	want[3 * EXTENT + 5] = 'a';
+	CHECK(holds("/s", want, 4 * EXTENT));
+	CHECK(jfs_punch_hole("/s", 5 * EXTENT, EXTENT) == 0);
+	CHECK(jfs_fallocate("/s", 5 * EXTENT, 0) == -1);
+	CHECK(holds("/s", want, 4 * EXTENT));
+	CHECK(jfs_save(IMG) == 0);
+	jfs_delete_r("/");
+	before = content_bytes();
+	CHECK(jfs_load(IMG) == 0);
+	after = content_bytes();
+	CHECK(before < 0 || after - before == EXTENT);		// just the piece with the 'a'
+	CHECK(holds("/s", want, 4 * EXTENT));
+	CHECK(jfs_punch_hole("/s", 0, 4 * EXTENT) == 0);
+	memset(want, 0, sizeof(want));
+	CHECK(holds("/s", want, 4 * EXTENT));
+	jfs_delete_r("/");
+	remove(IMG);
+}
+
+/**a directory takes as many sons as memory allows, through every path in*/
+static void test_wide(void) {
+	char path[32];
+	long i, n = 0, bad = 0;
+	for (i = 0; i < 200000; i++) {
+		sprintf(path, "/w/k%ld", i);
+		bad += jkdir(path, 0) != 0;
+	}
+	CHECK(bad == 0);
+	CHECK(jfs_clone("/w/k7", "/w/copy") == 1);
+	CHECK(create("f", "/w/f", 2, 'F') == OK);
+	CHECK(jfs_save(IMG) == 0);
+	CHECK(jfs_delete_r("/") == 200003);
+	CHECK(jfs_load(IMG) == 0);
+	CHECK(jfs_find("/w", "k*", 0, count_cb, &n) == 200000 && n == 200000);
+	CHECK(jfs_find("/", "copy", 0, count_cb, &n) == 1);
+	CHECK(jremove("/w") == 0);
+	for (i = 0; i < 1000; i++) {		// more root sons than the reclaimer queues
+		sprintf(path, "/r%ld", i);
+		bad += jkdir(path, 0) != 0;
+	}
+	CHECK(bad == 0 && jkdir("/r7/in", 0) == 0);
+	CHECK(jfs_delete_async("/") == 0);
+	CHECK(jfs_find("/", "*", 0, count_cb, &n) == 0 && jkdir("/r7", 0) == 0);
+	jfs_delete_async_wait();
+	CHECK(jfs_find("/", "*", 0, count_cb, &n) == 1 && jremove("/r7") == 0);
+	remove(IMG);
+}
+
+#ifdef JAMRAMFS_JOURNAL
+#define LOG "jamramfs_test.log"
+
+/**what was logged before and after a compaction is all there after a reopen*/
+static void test_journal(void) {
+	static char big[200000];
+	char name[256], path[258];
+	memset(name, 'n', 255);
+	name[255] = '\0';
+	sprintf(path, "/%s", name);
+	big[150000] = 'b';
+	CHECK(jfs_journal_open(LOG) == 0);		// a log with no snapshot yet
+	CHECK(create(name, path, 1, 'F') == OK);
+	CHECK(write_file_n(path, name, big, sizeof(big)) == (long) sizeof(big));
+	CHECK(jfs_journal_close() == 0);
+	CHECK(jfs_delete_r("/") == 1);
+	CHECK(jfs_journal_open(LOG) == 0);
+	CHECK(holds(path, big, sizeof(big)));
+	CHECK(jfs_journal_compact() == 0);		// the longest name, and holes, go in the snapshot
+	CHECK(jfs_journal_close() == 0);
+	CHECK(jfs_delete_r("/") == 1);
+	CHECK(jfs_journal_open(LOG) == 0);
+	CHECK(holds(path, big, sizeof(big)));
+	CHECK(delete(path, name) == OK);
+	CHECK(create("d", "/d", 1, 'D') == OK);
+	CHECK(create("a", "/d/a", 2, 'F') == OK);
+	CHECK(write_file_n("/d/a", "a", "before", 6) == 6);
+	CHECK(jfs_journal_compact() == 0);
+	CHECK(create("b", "/d/b", 2, 'F') == OK);
+	CHECK(write_file_n("/d/b", "b", "after", 5) == 5);
+	CHECK(write_file_n("/d/a", "a", "again", 5) == 5);
+	CHECK(jfs_journal_close() == 0);
+	CHECK(jfs_delete_r("/") == 3);
+	CHECK(jfs_journal_open(LOG) == 0);
+	CHECK(holds("/d/a", "again", 5));
+	CHECK(holds("/d/b", "after", 5));
+	CHECK(jfs_journal_compact() == 0);
+	CHECK(jfs_journal_close() == 0);
+	jfs_delete_r("/");
+	CHECK(jfs_journal_open(LOG) == 0);
+	CHECK(holds("/d/a", "again", 5));
+	CHECK(jfs_journal_close() == 0);
+	jfs_delete_r("/");
+	remove(LOG);
+	remove(LOG ".snap");
+}
+
+/**a change the log cannot take fails, and so does every one after it*/
+static void test_journal_full(void) {
+	static char big[16384];
+	struct rlimit old, lim;
+	char buf[8];
+	CHECK(jfs_journal_open(LOG) == 0);
+	CHECK(create("a", "/a", 1, 'F') == OK);
+	CHECK(write_file_n("/a", "a", "kept", 4) == 4);
+	CHECK(getrlimit(RLIMIT_FSIZE, &old) == 0);
+	lim = old;
+	lim.rlim_cur = 8192;		// the log is far from it, the next record goes past
+	signal(SIGXFSZ, SIG_IGN);
+	CHECK(setrlimit(RLIMIT_FSIZE, &lim) == 0);
+	CHECK(write_file_n("/a", "a", big, sizeof(big)) == -1);
+	CHECK(setrlimit(RLIMIT_FSIZE, &old) == 0);
+	CHECK(create("b", "/b", 1, 'F') == NO);
+	CHECK(write_file_n("/a", "a", "x", 1) == -1);
+	CHECK(read_file_n("/b", "b", buf, sizeof(buf)) == -1);
+	CHECK(jfs_journal_close() == -1);
+	jfs_delete_r("/");
+	CHECK(jfs_journal_open(LOG) == 0);
+	CHECK(holds("/a", "kept", 4));
+	CHECK(jfs_journal_close() == 0);
+	jfs_delete_r("/");
+	remove(LOG);
+	remove(LOG ".snap");
+}
+#endif
+
+/**
+ files copied up from a mounted image read and write like any other;
+ last, as an image stays mounted for good
+*/
+static void test_mount(void) {
+	static char big[200000];
+	const char * v;
+	memset(big, 'm', sizeof(big));
+	CHECK(create("big", "/big", 1, 'F') == OK);
+	CHECK(write_file_n("/big", "big", big, sizeof(big)) == (long) sizeof(big));
+	CHECK(create("small", "/small", 1, 'F') == OK);
+	CHECK(write_file_n("/small", "small", "s", 1) == 1);
+	CHECK(jfs_save(IMG) == 0);
+	jfs_delete_r("/");
+	CHECK(jfs_mount(IMG) == 0);
+	v = (const char *) jmap("/big", NULL);		// the image's own bytes, no copy
+	CHECK(v != NULL && memcmp(v, big, sizeof(big)) == 0);
+	CHECK(jmap("/big", NULL) == v);
+	CHECK(v == NULL || junmap(v) == 0);
+	CHECK(v == NULL || junmap(v) == 0);
+	v = (const char *) jmap("/small", NULL);
+	CHECK(v != NULL && v[0] == 's');
+	CHECK(pwrite_at("/small", "t", 1, 0) == -1);		// the image does not change under a view
+	CHECK(v == NULL || junmap(v) == 0);
+	CHECK(pwrite_at("/small", "t", 1, 0) == 1);
+	CHECK(holds("/small", "t", 1));
+	CHECK(jfs_clone("/big", "/big2") == 1);
+	CHECK(jfs_punch_hole("/big2", 10, 100) == 0);		// still the image's bytes, cut up here
+	CHECK(holds("/big", big, sizeof(big)));
+	CHECK(pwrite_at("/big", "y", 1, 100000) == 1);
+	big[100000] = 'y';
+	CHECK(holds("/big", big, sizeof(big)));
+	big[100000] = 'm';
+	memset(big + 10, 0, 100);
+	CHECK(holds("/big2", big, sizeof(big)));
+	remove(IMG);
+}
+
+//####################################################################################
+
+int main(void) {
+	test_create();
+	test_image();
+	test_image_big();
+	test_streams();
+	test_clone();
+	test_find();
+	test_sparse();
+	test_wide();
+#ifdef JAMRAMFS_JOURNAL
+	test_journal();
+	test_journal_full();
+#endif
+	test_mount();
+	if (failures)
+		fprintf(stderr, "%d checks failed\n", failures);
+	return failures != 0;
+}